@@ -0,0 +1,195 @@
+// MIT License
+//
+// Copyright (c) 2018 adafruit industries
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "pulsein_backend.h"
+#include <gpiod.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+//#define FOLLOW_PULSE  19
+
+static const char *consumername = "libgpiod_pulsein";
+
+static struct gpiod_chip *chip;
+// all lines, requested and read as one
+static struct gpiod_line_bulk lines;
+static bool request_events;
+// the line set_output took out of the bulk, -1 while capturing
+static int output_line = -1;
+
+#if defined(FOLLOW_PULSE)
+static struct gpiod_line *line2;
+#endif
+
+static int request_lines(void) {
+  if (request_events) {
+    // the kernel timestamps every transition for us
+    return gpiod_line_request_bulk_both_edges_events(&lines, consumername);
+  }
+  return gpiod_line_request_bulk_input(&lines, consumername);
+}
+
+static int line_index(struct gpiod_line *line) {
+  for (unsigned int i = 0; i < lines.num_lines; i++) {
+    if (gpiod_line_bulk_get_line(&lines, i) == line) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int gpiod_open(const char *device, const unsigned int *offsets,
+                      unsigned int num_lines, bool edge_events) {
+  if (num_lines > GPIOD_LINE_BULK_MAX_LINES) {
+    printf("libgpiod can't request more than %d lines at once\n",
+           GPIOD_LINE_BULK_MAX_LINES);
+    return -1;
+  }
+
+  chip = gpiod_chip_open_by_name(device);
+  if (!chip) {
+    printf("Unable to open chip: %s\n", device);
+    return -1;
+  }
+
+  gpiod_line_bulk_init(&lines);
+  for (unsigned int i = 0; i < num_lines; i++) {
+    struct gpiod_line *line = gpiod_chip_get_line(chip, offsets[i]);
+    if (!line) {
+      printf("Unable to open line: %u\n", offsets[i]);
+      return -1;
+    }
+    gpiod_line_bulk_add(&lines, line);
+  }
+
+#if defined(FOLLOW_PULSE)
+  // Helpful for debugging where we do our reads on a scope
+  line2 = gpiod_chip_get_line(chip, FOLLOW_PULSE);
+  if (!line2) {
+    printf("Unable to open line: %d\n", FOLLOW_PULSE);
+    return -1;
+  }
+  gpiod_line_release(line2);
+  if (gpiod_line_request_output(line2, consumername, 0) != 0) {
+    printf("Unable to set line %d to output\n", FOLLOW_PULSE);
+    return -1;
+  }
+#endif
+
+  request_events = edge_events;
+  if (request_lines() != 0) {
+    printf("Unable to set lines to input\n");
+    return -1;
+  }
+  return 0;
+}
+
+static void gpiod_close(void) {
+  gpiod_line_release_bulk(&lines);
+  gpiod_chip_close(chip);
+}
+
+static int gpiod_read_values(int *values) {
+  // one ioctl for every line
+  int ret = gpiod_line_get_value_bulk(&lines, values);
+#if defined(FOLLOW_PULSE)
+  if (ret == 0 && gpiod_line_set_value(line2, values[0]) != 0) {
+    printf("Unable to set line %d to active level\n", FOLLOW_PULSE);
+    exit(1);
+  }
+#endif
+  return ret;
+}
+
+static int gpiod_read_events(struct pulsein_edge *edges, unsigned int max,
+                             int64_t timeout_ns) {
+  struct gpiod_line_event events[max];
+  struct gpiod_line_bulk event_lines;
+  struct timespec timeout = {timeout_ns / 1000000000, timeout_ns % 1000000000};
+
+  int ret = gpiod_line_event_wait_bulk(&lines, &timeout, &event_lines);
+  if (ret <= 0) {
+    return ret;
+  }
+
+  unsigned int count = 0;
+  for (unsigned int i = 0; i < event_lines.num_lines && count < max; i++) {
+    struct gpiod_line *line = gpiod_line_bulk_get_line(&event_lines, i);
+    int num_events = gpiod_line_event_read_multiple(line, events, max - count);
+    if (num_events < 0) {
+      return -1;
+    }
+    for (int e = 0; e < num_events; e++) {
+      edges[count].timestamp_ns =
+          events[e].ts.tv_sec * 1000000000LL + events[e].ts.tv_nsec;
+      edges[count].line = line_index(line);
+      edges[count].value = (events[e].event_type == GPIOD_LINE_EVENT_RISING_EDGE);
+#if defined(FOLLOW_PULSE)
+      if (edges[count].line == 0 &&
+          gpiod_line_set_value(line2, edges[count].value) != 0) {
+        printf("Unable to set line %d to active level\n", FOLLOW_PULSE);
+        exit(1);
+      }
+#endif
+      count++;
+    }
+  }
+  return count;
+}
+
+static int gpiod_set_output(unsigned int index, int value) {
+  struct gpiod_line *line = gpiod_line_bulk_get_line(&lines, index);
+
+  if (output_line == (int)index) {
+    return gpiod_line_set_value(line, value);
+  }
+  // lines of a bulk request can only be read together, so give them all up
+  gpiod_line_release_bulk(&lines);
+  output_line = index;
+  return gpiod_line_request_output(line, consumername, value);
+}
+
+static int gpiod_set_input(unsigned int index) {
+  // release for input usage
+  gpiod_line_release(gpiod_line_bulk_get_line(&lines, index));
+  output_line = -1;
+  return request_lines();
+}
+
+static int64_t gpiod_timestamp(void) {
+  // CLOCK_MONOTONIC_RAW doesn't step or slew with NTP
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+const struct pulsein_backend gpiod_backend = {
+    .name = "gpiod",
+    .open = gpiod_open,
+    .close = gpiod_close,
+    .read_values = gpiod_read_values,
+    .read_events = gpiod_read_events,
+    .set_output = gpiod_set_output,
+    .set_input = gpiod_set_input,
+    .timestamp = gpiod_timestamp,
+};
@@ -0,0 +1,229 @@
+// MIT License
+//
+// Copyright (c) 2018 adafruit industries
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// libgpiod v2 flavour of the gpiod backend, build with `make GPIOD_API=2`.
+// All lines live in one request, switching a line between input and output
+// for a trigger pulse is a single reconfigure ioctl rather than releasing
+// and requesting the lines again.
+
+#include "pulsein_backend.h"
+#include <gpiod.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// edges pulled out of the request per read
+#define EDGE_BUFFER_SIZE 64
+// GPIO_V2_LINES_MAX, the kernel's limit for one request
+#define MAX_REQUEST_LINES 64
+
+static const char *consumername = "libgpiod_pulsein";
+
+static struct gpiod_chip *chip;
+static struct gpiod_line_request *request;
+static struct gpiod_edge_event_buffer *edge_buffer;
+// every line as an input, what the request goes back to after a trigger
+static struct gpiod_line_config *input_config;
+static unsigned int line_offsets[MAX_REQUEST_LINES];
+static unsigned int num_request_lines;
+static bool request_events;
+// the line set_output reconfigured, -1 while capturing
+static int output_line = -1;
+
+static struct gpiod_line_settings *input_settings(void) {
+  struct gpiod_line_settings *settings = gpiod_line_settings_new();
+  if (!settings) {
+    return NULL;
+  }
+  gpiod_line_settings_set_direction(settings, GPIOD_LINE_DIRECTION_INPUT);
+  if (request_events) {
+    // the kernel timestamps every transition for us
+    gpiod_line_settings_set_edge_detection(settings, GPIOD_LINE_EDGE_BOTH);
+    gpiod_line_settings_set_event_clock(settings, GPIOD_LINE_CLOCK_MONOTONIC);
+  }
+  return settings;
+}
+
+static int line_index(unsigned int offset) {
+  for (unsigned int i = 0; i < num_request_lines; i++) {
+    if (line_offsets[i] == offset) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int gpiod_open(const char *device, const unsigned int *offsets,
+                      unsigned int num_lines, bool edge_events) {
+  char path[PATH_MAX];
+
+  if (num_lines > MAX_REQUEST_LINES) {
+    printf("libgpiod can't request more than %d lines at once\n",
+           MAX_REQUEST_LINES);
+    return -1;
+  }
+
+  // accept the same chip names v1's gpiod_chip_open_lookup() did
+  if (device[0] == '/') {
+    snprintf(path, sizeof(path), "%s", device);
+  } else if (device[0] >= '0' && device[0] <= '9') {
+    snprintf(path, sizeof(path), "/dev/gpiochip%s", device);
+  } else {
+    snprintf(path, sizeof(path), "/dev/%s", device);
+  }
+  chip = gpiod_chip_open(path);
+  if (!chip) {
+    printf("Unable to open chip: %s\n", device);
+    return -1;
+  }
+
+  for (unsigned int i = 0; i < num_lines; i++) {
+    line_offsets[i] = offsets[i];
+  }
+  num_request_lines = num_lines;
+  request_events = edge_events;
+
+  struct gpiod_line_settings *settings = input_settings();
+  input_config = gpiod_line_config_new();
+  if (!settings || !input_config ||
+      gpiod_line_config_add_line_settings(input_config, line_offsets,
+                                          num_lines, settings) != 0) {
+    printf("Unable to configure lines\n");
+    return -1;
+  }
+  gpiod_line_settings_free(settings);
+
+  struct gpiod_request_config *request_config = gpiod_request_config_new();
+  if (!request_config) {
+    printf("Unable to configure lines\n");
+    return -1;
+  }
+  gpiod_request_config_set_consumer(request_config, consumername);
+  request = gpiod_chip_request_lines(chip, request_config, input_config);
+  gpiod_request_config_free(request_config);
+  if (!request) {
+    printf("Unable to set lines to input\n");
+    return -1;
+  }
+
+  edge_buffer = gpiod_edge_event_buffer_new(EDGE_BUFFER_SIZE);
+  if (!edge_buffer) {
+    printf("Unable to allocate the edge event buffer\n");
+    return -1;
+  }
+  return 0;
+}
+
+static void gpiod_close(void) {
+  gpiod_edge_event_buffer_free(edge_buffer);
+  gpiod_line_request_release(request);
+  gpiod_line_config_free(input_config);
+  gpiod_chip_close(chip);
+}
+
+static int gpiod_read_values(int *values) {
+  enum gpiod_line_value line_values[MAX_REQUEST_LINES];
+
+  // one ioctl for every line
+  if (gpiod_line_request_get_values(request, line_values) != 0) {
+    return -1;
+  }
+  for (unsigned int i = 0; i < num_request_lines; i++) {
+    values[i] = line_values[i];
+  }
+  return 0;
+}
+
+static int gpiod_read_events(struct pulsein_edge *edges, unsigned int max,
+                             int64_t timeout_ns) {
+  int ret = gpiod_line_request_wait_edge_events(request, timeout_ns);
+  if (ret <= 0) {
+    return ret;
+  }
+
+  if (max > EDGE_BUFFER_SIZE) {
+    max = EDGE_BUFFER_SIZE;
+  }
+  int num_events = gpiod_line_request_read_edge_events(request, edge_buffer, max);
+  for (int i = 0; i < num_events; i++) {
+    struct gpiod_edge_event *event =
+        gpiod_edge_event_buffer_get_event(edge_buffer, i);
+    edges[i].timestamp_ns = gpiod_edge_event_get_timestamp_ns(event);
+    edges[i].line = line_index(gpiod_edge_event_get_line_offset(event));
+    edges[i].value = (gpiod_edge_event_get_event_type(event) ==
+                      GPIOD_EDGE_EVENT_RISING_EDGE);
+  }
+  return num_events;
+}
+
+static int gpiod_set_output(unsigned int index, int value) {
+  if (output_line == (int)index) {
+    return gpiod_line_request_set_value(request, line_offsets[index], value);
+  }
+
+  // every other line keeps capturing, only this one changes direction
+  struct gpiod_line_settings *settings = input_settings();
+  struct gpiod_line_config *config = gpiod_line_config_new();
+  int ret = -1;
+  if (settings && config &&
+      gpiod_line_config_add_line_settings(config, line_offsets,
+                                          num_request_lines, settings) == 0) {
+    gpiod_line_settings_set_direction(settings, GPIOD_LINE_DIRECTION_OUTPUT);
+    gpiod_line_settings_set_edge_detection(settings, GPIOD_LINE_EDGE_NONE);
+    gpiod_line_settings_set_output_value(settings, value);
+    if (gpiod_line_config_add_line_settings(config, &line_offsets[index], 1,
+                                            settings) == 0) {
+      ret = gpiod_line_request_reconfigure_lines(request, config);
+    }
+  }
+  gpiod_line_config_free(config);
+  gpiod_line_settings_free(settings);
+
+  if (ret == 0) {
+    output_line = index;
+  }
+  return ret;
+}
+
+static int gpiod_set_input(unsigned int index) {
+  output_line = -1;
+  return gpiod_line_request_reconfigure_lines(request, input_config);
+}
+
+static int64_t gpiod_timestamp(void) {
+  // CLOCK_MONOTONIC_RAW doesn't step or slew with NTP
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+const struct pulsein_backend gpiod_backend = {
+    .name = "gpiod",
+    .open = gpiod_open,
+    .close = gpiod_close,
+    .read_values = gpiod_read_values,
+    .read_events = gpiod_read_events,
+    .set_output = gpiod_set_output,
+    .set_input = gpiod_set_input,
+    .timestamp = gpiod_timestamp,
+};
@@ -0,0 +1,216 @@
+// MIT License
+//
+// Copyright (c) 2018 adafruit industries
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "pulsein_backend.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// like the kernel's per line event fifo, older edges are dropped when a
+// reader falls further behind than this
+#define SIM_EVENT_QUEUE 16
+
+static int64_t *widths_ns;
+// boundary[i] is the time from the start of a cycle to the end of width i
+static int64_t *boundary_ns;
+static size_t num_widths;
+static int64_t cycle_ns;
+static int idle_level;
+static unsigned int sim_lines;
+
+static int64_t start_ns;
+// edges are numbered from 1 after start, next_line is the line of
+// next_edge read_events reports next
+static uint64_t next_edge;
+static unsigned int next_line;
+
+static int64_t sim_timestamp(void) {
+  // clock_nanosleep can't sleep on CLOCK_MONOTONIC_RAW
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void sleep_until(int64_t when_ns) {
+  struct timespec when = {when_ns / 1000000000, when_ns % 1000000000};
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, NULL) ==
+         EINTR)
+    ;
+}
+
+static int64_t edge_time(uint64_t edge) {
+  return start_ns + ((edge - 1) / num_widths) * cycle_ns +
+         boundary_ns[(edge - 1) % num_widths];
+}
+
+// number of edges at or before when
+static uint64_t edges_until(int64_t when_ns) {
+  if (when_ns < start_ns) {
+    return 0;
+  }
+  int64_t elapsed = when_ns - start_ns;
+  uint64_t edges = (elapsed / cycle_ns) * num_widths;
+  int64_t position = elapsed % cycle_ns;
+  // first boundary past position
+  size_t low = 0, high = num_widths;
+  while (low < high) {
+    size_t mid = (low + high) / 2;
+    if (boundary_ns[mid] <= position) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return edges + low;
+}
+
+static void restart(void) {
+  start_ns = sim_timestamp();
+  next_edge = 1;
+  next_line = 0;
+}
+
+int sim_backend_configure(const char *widths, unsigned long edge_rate,
+                          bool idle_state) {
+  size_t capacity = 1;
+  for (const char *c = widths; c && *c; c++) {
+    capacity += (*c == ',');
+  }
+  free(widths_ns);
+  free(boundary_ns);
+  widths_ns = calloc(capacity, sizeof(int64_t));
+  boundary_ns = calloc(capacity, sizeof(int64_t));
+  if (!widths_ns || !boundary_ns) {
+    return -1;
+  }
+
+  num_widths = 0;
+  if (widths) {
+    const char *c = widths;
+    for (;;) {
+      char *end;
+      unsigned long width_us = strtoul(c, &end, 10);
+      if (end == c || width_us == 0) {
+        return -1;
+      }
+      widths_ns[num_widths++] = width_us * 1000LL;
+      if (*end == '\0') {
+        break;
+      }
+      if (*end != ',') {
+        return -1;
+      }
+      c = end + 1;
+    }
+  } else if (edge_rate > 0) {
+    widths_ns[num_widths++] = 1000000000LL / edge_rate;
+  } else {
+    return -1;
+  }
+
+  cycle_ns = 0;
+  for (size_t i = 0; i < num_widths; i++) {
+    cycle_ns += widths_ns[i];
+    boundary_ns[i] = cycle_ns;
+  }
+  if (cycle_ns == 0) {
+    return -1;
+  }
+  idle_level = idle_state;
+  return 0;
+}
+
+static int sim_open(const char *chip, const unsigned int *offsets,
+                    unsigned int num_lines, bool edge_events) {
+  if (num_widths == 0) {
+    printf("The simulated backend has no pulse train to replay\n");
+    return -1;
+  }
+  sim_lines = num_lines;
+  restart();
+  return 0;
+}
+
+static void sim_close(void) {}
+
+static int sim_read_values(int *values) {
+  // every line replays the same train
+  int level = idle_level ^ (edges_until(sim_timestamp()) & 1);
+  for (unsigned int i = 0; i < sim_lines; i++) {
+    values[i] = level;
+  }
+  return 0;
+}
+
+static int sim_read_events(struct pulsein_edge *edges, unsigned int max,
+                           int64_t timeout_ns) {
+  int64_t now = sim_timestamp();
+
+  if (edge_time(next_edge) > now) {
+    int64_t wake = now + timeout_ns;
+    if (edge_time(next_edge) < wake) {
+      wake = edge_time(next_edge);
+    }
+    sleep_until(wake);
+    now = sim_timestamp();
+  }
+
+  uint64_t last_edge = edges_until(now);
+  if (last_edge >= next_edge + SIM_EVENT_QUEUE) {
+    // the queue overflowed while nobody was reading
+    next_edge = last_edge - SIM_EVENT_QUEUE + 1;
+    next_line = 0;
+  }
+
+  unsigned int count = 0;
+  while (count < max && next_edge <= last_edge) {
+    edges[count].timestamp_ns = edge_time(next_edge);
+    edges[count].line = next_line;
+    edges[count].value = idle_level ^ (next_edge & 1);
+    count++;
+    if (++next_line == sim_lines) {
+      next_line = 0;
+      next_edge++;
+    }
+  }
+  return count;
+}
+
+static int sim_set_output(unsigned int line, int value) { return 0; }
+
+static int sim_set_input(unsigned int line) {
+  // the 'sensor' answers the trigger
+  restart();
+  return 0;
+}
+
+const struct pulsein_backend sim_backend = {
+    .name = "sim",
+    .open = sim_open,
+    .close = sim_close,
+    .read_values = sim_read_values,
+    .read_events = sim_read_events,
+    .set_output = sim_set_output,
+    .set_input = sim_set_input,
+    .timestamp = sim_timestamp,
+};
@@ -0,0 +1,158 @@
+// MIT License
+//
+// Copyright (c) 2018 adafruit industries
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Throughput of the ring buffer between one producer thread putting widths
+// as the capture thread does and a consumer getting them as the IPC
+// commands do. `make bench` builds it twice:
+//
+//   ring_bench        the lock-free ring in circular_buffer.c, no locking
+//   ring_bench_mutex  the ring as it was before it went lock-free (a copy
+//                     in baseline/), every call guarded by one mutex the
+//                     way the capture and IPC threads used to, the
+//                     producer spinning on trylock
+//
+// The producer keeps the ring at most half full, yielding to the consumer
+// meanwhile, so every put is also a get and nothing is overwritten.
+//
+//   ring_bench [pulses] [ring size]
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "circular_buffer.h"
+
+#define DEFAULT_PULSES 20000000UL
+#define DEFAULT_RING_SIZE 1000
+
+static cbuf_handle_t ring;
+static size_t ring_size;
+static unsigned long pulses;
+static atomic_bool producer_done;
+
+#if defined(RING_BENCH_MUTEX)
+static pthread_mutex_t ring_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static void ring_put(storage_t width) {
+  while (pthread_mutex_trylock(&ring_mtx) != 0)
+    ;
+  circular_buf_put(ring, width);
+  pthread_mutex_unlock(&ring_mtx);
+}
+
+static int ring_get(storage_t *width) {
+  pthread_mutex_lock(&ring_mtx);
+  int ret = circular_buf_get(ring, width);
+  pthread_mutex_unlock(&ring_mtx);
+  return ret;
+}
+
+static size_t ring_count(void) {
+  pthread_mutex_lock(&ring_mtx);
+  size_t count = circular_buf_size(ring);
+  pthread_mutex_unlock(&ring_mtx);
+  return count;
+}
+#else
+static void ring_put(storage_t width) { circular_buf_put(ring, width); }
+
+static int ring_get(storage_t *width) { return circular_buf_get(ring, width); }
+
+static size_t ring_count(void) { return circular_buf_size(ring); }
+#endif
+
+static int64_t monotonic_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void *producer(void *args) {
+  for (unsigned long i = 0; i < pulses; i++) {
+    while (ring_count() >= ring_size / 2) {
+      sched_yield();
+    }
+    ring_put(i);
+  }
+  atomic_store(&producer_done, true);
+  return NULL;
+}
+
+// counts the widths that don't come out in order into *args
+static void *consumer(void *args) {
+  unsigned long *errors = args;
+  storage_t width, expected = 0;
+  for (;;) {
+    if (ring_get(&width) == 0) {
+      *errors += (width != expected);
+      expected = width + 1;
+    } else if (atomic_load(&producer_done) && (ring_count() == 0)) {
+      return NULL;
+    } else {
+      sched_yield();
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  pthread_t producer_thread, consumer_thread;
+  unsigned long errors = 0;
+
+  pulses = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_PULSES;
+  ring_size = argc > 2 ? strtoul(argv[2], NULL, 10) : DEFAULT_RING_SIZE;
+  if ((pulses == 0) || (ring_size < 2)) {
+    printf("usage: %s [pulses] [ring size >= 2]\n", argv[0]);
+    exit(1);
+  }
+
+  // the lock-free ring wants a power of two above ring_size, this is
+  // always enough
+  storage_t *storage = calloc(2 * ring_size, sizeof(storage_t));
+  if (!storage) {
+    printf("Unable to allocate the ring\n");
+    exit(1);
+  }
+  ring = circular_buf_init(storage, ring_size);
+
+  int64_t start = monotonic_ns();
+  pthread_create(&consumer_thread, NULL, consumer, &errors);
+  pthread_create(&producer_thread, NULL, producer, NULL);
+  pthread_join(producer_thread, NULL);
+  pthread_join(consumer_thread, NULL);
+  int64_t elapsed_ns = monotonic_ns() - start;
+
+#if defined(RING_BENCH_MUTEX)
+  const char *variant = "mutex";
+#else
+  const char *variant = "lock-free";
+#endif
+  printf("%-9s %lu puts and gets in %.3f s, %.1f M/s, %lu out of order\n",
+         variant, pulses, elapsed_ns / 1e9, pulses * 1e3 / elapsed_ns,
+         errors);
+  circular_buf_free(ring);
+  free(storage);
+  return errors != 0;
+}
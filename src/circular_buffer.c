@@ -1,60 +1,169 @@
 #include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <assert.h>
 
 #include "circular_buffer.h"
 
 // The definition of our circular buffer structure is hidden from the user
+//
+// This is a single producer / single consumer ring. head and tail are free
+// running counters, the slot for a counter is (counter & mask). Only the
+// producer moves head. The consumer moves tail, except when the producer
+// overwrites the oldest element of a full buffer; both sides then race with a
+// compare-and-swap on tail and the loser simply retries (consumer) or finds
+// the space already freed (producer). There are always more slots than
+// elements (slots > max), so the producer never writes the slot a consumer
+// with an up-to-date tail is reading.
 struct circular_buf_t {
-	storage_t* buffer;
-	size_t head;
-	size_t tail;
-	size_t max; //of the buffer
-	bool full;
+	unsigned char* buffer;
+	uint32_t max; //of the buffer
+	uint32_t mask; //slots - 1
+	uint32_t element_size; //bytes per element
+	struct circular_buf_indices* idx; //either &local or shared memory
+	struct circular_buf_indices local;
 };
 
 #pragma mark - Private Functions -
 
-static void advance_pointer(cbuf_handle_t cbuf)
+static uint32_t load_count(cbuf_handle_t cbuf)
 {
 	assert(cbuf);
 
-	if(cbuf->full)
-    {
-        cbuf->tail = (cbuf->tail + 1) % cbuf->max;
-    }
-
-	cbuf->head = (cbuf->head + 1) % cbuf->max;
+	// tail first, head can only have moved further on since
+	uint32_t tail = atomic_load_explicit(&cbuf->idx->tail, memory_order_acquire);
+	uint32_t head = atomic_load_explicit(&cbuf->idx->head, memory_order_acquire);
+	uint32_t size = head - tail;
 
-	// We mark full because we will advance tail on the next time around
-	cbuf->full = (cbuf->head == cbuf->tail);
+	// a racing overwrite can leave us one past max for a moment
+	return size > cbuf->max ? cbuf->max : size;
 }
 
-static void retreat_pointer(cbuf_handle_t cbuf)
+static cbuf_handle_t init_with_indices(void* buffer, size_t size,
+	size_t element_size, struct circular_buf_indices* indices)
 {
+	assert(buffer && size && element_size);
+	// the free running indices must be able to tell full from empty
+	assert(size < (1u << 31));
+
+	cbuf_handle_t cbuf = aligned_alloc(_Alignof(circular_buf_t),
+		sizeof(circular_buf_t));
 	assert(cbuf);
 
-	cbuf->full = false;
-	cbuf->tail = (cbuf->tail + 1) % cbuf->max;
+	cbuf->buffer = buffer;
+	cbuf->max = size;
+	cbuf->mask = circular_buf_slots(size) - 1;
+	cbuf->element_size = element_size;
+	cbuf->idx = indices ? indices : &cbuf->local;
+	atomic_init(&cbuf->idx->head, 0);
+	atomic_init(&cbuf->idx->seq, 0);
+	atomic_init(&cbuf->idx->overflows, 0);
+	atomic_init(&cbuf->idx->tail, 0);
+
+	assert(circular_buf_empty(cbuf));
+
+	return cbuf;
+}
+
+static unsigned char* slot(cbuf_handle_t cbuf, uint32_t position)
+{
+	return &cbuf->buffer[(size_t)(position & cbuf->mask) * cbuf->element_size];
+}
+
+// the producer's half of the seqlock around writing a slot, storage_t
+// elements only. head is published before seq goes even again, so that an
+// even seq means every write so far shows in head.
+static void write_slot(cbuf_handle_t cbuf, uint32_t head, storage_t data)
+{
+	uint32_t seq = atomic_load_explicit(&cbuf->idx->seq, memory_order_relaxed);
+
+	atomic_store_explicit(&cbuf->idx->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	*(storage_t*)slot(cbuf, head) = data;
+
+	atomic_store_explicit(&cbuf->idx->head, head + 1, memory_order_release);
+	atomic_store_explicit(&cbuf->idx->seq, seq + 2, memory_order_release);
+}
+
+// producer only, so no read-modify-write needed
+static void add_overflows(cbuf_handle_t cbuf, uint32_t count)
+{
+	atomic_store_explicit(&cbuf->idx->overflows,
+		atomic_load_explicit(&cbuf->idx->overflows, memory_order_relaxed) + count,
+		memory_order_relaxed);
+}
+
+// The storage between two positions is at most two contiguous pieces, the
+// second one starting at the beginning of the buffer when the first wraps
+static size_t first_piece(cbuf_handle_t cbuf, uint32_t position, size_t count)
+{
+	size_t to_end = (size_t)cbuf->mask + 1 - (position & cbuf->mask);
+
+	return count < to_end ? count : to_end;
+}
+
+static void copy_out(cbuf_handle_t cbuf, uint32_t position, void* data,
+	size_t count)
+{
+	size_t first = first_piece(cbuf, position, count) * cbuf->element_size;
+
+	count *= cbuf->element_size;
+	memcpy(data, slot(cbuf, position), first);
+	memcpy((unsigned char*)data + first, cbuf->buffer, count - first);
+}
+
+// write_slot for several values, under a single seq bump
+static void write_range(cbuf_handle_t cbuf, uint32_t head,
+	const void* data, size_t count)
+{
+	uint32_t seq = atomic_load_explicit(&cbuf->idx->seq, memory_order_relaxed);
+	size_t first = first_piece(cbuf, head, count) * cbuf->element_size;
+	size_t total = count * cbuf->element_size;
+
+	atomic_store_explicit(&cbuf->idx->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	memcpy(slot(cbuf, head), data, first);
+	memcpy(cbuf->buffer, (const unsigned char*)data + first, total - first);
+
+	atomic_store_explicit(&cbuf->idx->head, head + count, memory_order_release);
+	atomic_store_explicit(&cbuf->idx->seq, seq + 2, memory_order_release);
 }
 
 #pragma mark - APIs -
 
-cbuf_handle_t circular_buf_init(storage_t* buffer, size_t size)
+size_t circular_buf_slots(size_t size)
 {
-	assert(buffer && size);
+	size_t slots = 1;
 
-	cbuf_handle_t cbuf = malloc(sizeof(circular_buf_t));
-	assert(cbuf);
+	while(slots <= size)
+	{
+		slots <<= 1;
+	}
 
-	cbuf->buffer = buffer;
-	cbuf->max = size;
-	circular_buf_reset(cbuf);
+	return slots;
+}
 
-	assert(circular_buf_empty(cbuf));
+cbuf_handle_t circular_buf_init(storage_t* buffer, size_t size)
+{
+	return init_with_indices(buffer, size, sizeof(storage_t), NULL);
+}
 
-	return cbuf;
+cbuf_handle_t circular_buf_init_elements(void* buffer, size_t size,
+	size_t element_size)
+{
+	return init_with_indices(buffer, size, element_size, NULL);
+}
+
+cbuf_handle_t circular_buf_init_shared(void* buffer, size_t size,
+	size_t element_size, struct circular_buf_indices* indices)
+{
+	assert(indices);
+
+	return init_with_indices(buffer, size, element_size, indices);
 }
 
 void circular_buf_free(cbuf_handle_t cbuf)
@@ -67,31 +176,28 @@ void circular_buf_reset(cbuf_handle_t cbuf)
 {
     assert(cbuf);
 
-    cbuf->head = 0;
-    cbuf->tail = 0;
-    cbuf->full = false;
+    uint32_t tail = atomic_load_explicit(&cbuf->idx->tail, memory_order_acquire);
+    uint32_t head;
+
+    do
+    {
+        head = atomic_load_explicit(&cbuf->idx->head, memory_order_acquire);
+    } while(!atomic_compare_exchange_weak_explicit(&cbuf->idx->tail, &tail,
+        head, memory_order_acq_rel, memory_order_acquire));
 }
 
 size_t circular_buf_size(cbuf_handle_t cbuf)
 {
 	assert(cbuf);
 
-	size_t size = cbuf->max;
-
-	if(!cbuf->full)
-	{
-		if(cbuf->head >= cbuf->tail)
-		{
-			size = (cbuf->head - cbuf->tail);
-		}
-		else
-		{
-			size = (cbuf->max + cbuf->head - cbuf->tail);
-		}
+	return load_count(cbuf);
+}
 
-	}
+size_t circular_buf_element_size(cbuf_handle_t cbuf)
+{
+	assert(cbuf);
 
-	return size;
+	return cbuf->element_size;
 }
 
 size_t circular_buf_capacity(cbuf_handle_t cbuf)
@@ -103,76 +209,326 @@ size_t circular_buf_capacity(cbuf_handle_t cbuf)
 
 void circular_buf_put(cbuf_handle_t cbuf, storage_t data)
 {
-	assert(cbuf && cbuf->buffer);
+	assert(cbuf && cbuf->buffer && cbuf->element_size == sizeof(storage_t));
 
-    cbuf->buffer[cbuf->head] = data;
+    uint32_t head = atomic_load_explicit(&cbuf->idx->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&cbuf->idx->tail, memory_order_acquire);
+
+    if((uint32_t)(head - tail) >= cbuf->max)
+    {
+        // Drop the oldest element. If this fails the consumer just took it,
+        // which frees the space all the same.
+        if(atomic_compare_exchange_strong_explicit(&cbuf->idx->tail, &tail,
+            tail + 1, memory_order_acq_rel, memory_order_acquire))
+        {
+            add_overflows(cbuf, 1);
+        }
+    }
 
-    advance_pointer(cbuf);
+    write_slot(cbuf, head, data);
 }
 
 int circular_buf_put2(cbuf_handle_t cbuf, storage_t data)
 {
     int r = -1;
 
-    assert(cbuf && cbuf->buffer);
+    assert(cbuf && cbuf->buffer && cbuf->element_size == sizeof(storage_t));
+
+    uint32_t head = atomic_load_explicit(&cbuf->idx->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&cbuf->idx->tail, memory_order_acquire);
 
-    if(!circular_buf_full(cbuf))
+    if((uint32_t)(head - tail) < cbuf->max)
     {
-        cbuf->buffer[cbuf->head] = data;
-        advance_pointer(cbuf);
+        write_slot(cbuf, head, data);
         r = 0;
     }
+    else
+    {
+        add_overflows(cbuf, 1);
+    }
 
     return r;
 }
 
-int circular_buf_get(cbuf_handle_t cbuf, storage_t* data)
+size_t circular_buf_put_range2(cbuf_handle_t cbuf, const void* data,
+	size_t len)
 {
     assert(cbuf && data && cbuf->buffer);
 
-    int r = -1;
+    uint32_t head = atomic_load_explicit(&cbuf->idx->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&cbuf->idx->tail, memory_order_acquire);
+    uint32_t size = head - tail;
+    size_t room = size < cbuf->max ? cbuf->max - size : 0;
+    size_t count = len < room ? len : room;
 
-    if(!circular_buf_empty(cbuf))
+    if(count < len)
     {
-        *data = cbuf->buffer[cbuf->tail];
-        retreat_pointer(cbuf);
+        add_overflows(cbuf, len - count);
+    }
+    if(count > 0)
+    {
+        write_range(cbuf, head, data, count);
+    }
 
-        r = 0;
+    return count;
+}
+
+size_t circular_buf_put_range(cbuf_handle_t cbuf, const void* data,
+	size_t len)
+{
+    assert(cbuf && data && cbuf->buffer);
+
+    uint32_t dropped = 0;
+
+    // only the newest max values can stay
+    if(len > cbuf->max)
+    {
+        dropped = len - cbuf->max;
+        data = (const unsigned char*)data +
+            (size_t)dropped * cbuf->element_size;
+        len = cbuf->max;
+    }
+    if(len == 0)
+    {
+        return 0;
     }
 
-    return r;
+    uint32_t head = atomic_load_explicit(&cbuf->idx->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&cbuf->idx->tail, memory_order_acquire);
+
+    // Drop as many of the oldest as it takes, like put. A failed exchange
+    // means the consumer took some, so look again.
+    while((uint32_t)(head - tail) + len > cbuf->max)
+    {
+        uint32_t new_tail = head + len - cbuf->max;
+        if(atomic_compare_exchange_weak_explicit(&cbuf->idx->tail, &tail,
+            new_tail, memory_order_acq_rel, memory_order_acquire))
+        {
+            dropped += new_tail - tail;
+            break;
+        }
+    }
+    if(dropped)
+    {
+        add_overflows(cbuf, dropped);
+    }
+
+    write_range(cbuf, head, data, len);
+
+    return len;
 }
 
-int circular_buf_peek(cbuf_handle_t cbuf, int index, storage_t* data)
+int circular_buf_get(cbuf_handle_t cbuf, void* data)
 {
     assert(cbuf && data && cbuf->buffer);
 
-    int r = -1;
+    uint32_t tail = atomic_load_explicit(&cbuf->idx->tail, memory_order_acquire);
 
-    if(!circular_buf_empty(cbuf))
+    for(;;)
     {
-      if ((index < 0) || (index >= cbuf->max)) {
-	return -1;
-      }
-      size_t peekptr = (cbuf->tail + index) % cbuf->max;
-      *data = cbuf->buffer[peekptr];
+        uint32_t head = atomic_load_explicit(&cbuf->idx->head,
+            memory_order_acquire);
+        if(head == tail)
+        {
+            return -1;
+        }
+
+        copy_out(cbuf, tail, data, 1);
+
+        // on failure tail is reloaded and we try again with the new oldest
+        if(atomic_compare_exchange_weak_explicit(&cbuf->idx->tail, &tail,
+            tail + 1, memory_order_acq_rel, memory_order_acquire))
+        {
+            return 0;
+        }
+    }
+}
+
+size_t circular_buf_get_range(cbuf_handle_t cbuf, void* data, size_t len)
+{
+    assert(cbuf && data && cbuf->buffer);
 
-      r = 0;
+    uint32_t tail = atomic_load_explicit(&cbuf->idx->tail, memory_order_acquire);
+
+    for(;;)
+    {
+        uint32_t head = atomic_load_explicit(&cbuf->idx->head,
+            memory_order_acquire);
+        size_t count = (uint32_t)(head - tail);
+
+        if(count > cbuf->max)
+        {
+            count = cbuf->max;
+        }
+        if(count > len)
+        {
+            count = len;
+        }
+        if(count == 0)
+        {
+            return 0;
+        }
+
+        copy_out(cbuf, tail, data, count);
+
+        // all or nothing, an overwrite in the meantime means copy again
+        if(atomic_compare_exchange_weak_explicit(&cbuf->idx->tail, &tail,
+            tail + count, memory_order_acq_rel, memory_order_acquire))
+        {
+            return count;
+        }
     }
+}
 
-    return r;
+int circular_buf_peek(cbuf_handle_t cbuf, int index, void* data)
+{
+    assert(cbuf && data && cbuf->buffer);
+
+    uint32_t tail = atomic_load_explicit(&cbuf->idx->tail, memory_order_acquire);
+
+    for(;;)
+    {
+        uint32_t head = atomic_load_explicit(&cbuf->idx->head,
+            memory_order_acquire);
+        if((index < 0) || ((uint32_t)index >= (uint32_t)(head - tail)))
+        {
+            return -1;
+        }
+
+        copy_out(cbuf, tail + index, data, 1);
+
+        // if tail hasn't moved, the slot can't have been reused under us
+        atomic_thread_fence(memory_order_acquire);
+        uint32_t check = atomic_load_explicit(&cbuf->idx->tail,
+            memory_order_relaxed);
+        if(check == tail)
+        {
+            return 0;
+        }
+        tail = check;
+    }
+}
+
+size_t circular_buf_peek_span(cbuf_handle_t cbuf,
+	struct circular_buf_span* span, size_t len)
+{
+    assert(cbuf && span && cbuf->buffer);
+
+    uint32_t tail = atomic_load_explicit(&cbuf->idx->tail, memory_order_acquire);
+    uint32_t head = atomic_load_explicit(&cbuf->idx->head, memory_order_acquire);
+    size_t count = (uint32_t)(head - tail);
+
+    // a racing overwrite can leave us one past max for a moment
+    if(count > cbuf->max)
+    {
+        count = cbuf->max;
+    }
+    if(count > len)
+    {
+        count = len;
+    }
+
+    span->position = tail;
+    span->first = slot(cbuf, tail);
+    span->first_len = first_piece(cbuf, tail, count);
+    span->second = cbuf->buffer;
+    span->second_len = count - span->first_len;
+
+    return count;
+}
+
+int circular_buf_consume(cbuf_handle_t cbuf,
+	const struct circular_buf_span* span, size_t count)
+{
+    assert(cbuf && span);
+    assert(count <= span->first_len + span->second_len);
+
+    uint32_t tail = span->position;
+
+    // tail not having moved means nobody took or overwrote the span
+    return atomic_compare_exchange_strong_explicit(&cbuf->idx->tail, &tail,
+        tail + count, memory_order_acq_rel, memory_order_acquire) ? 0 : -1;
+}
+
+uint32_t circular_buf_head(cbuf_handle_t cbuf)
+{
+	assert(cbuf);
+
+	return atomic_load_explicit(&cbuf->idx->head, memory_order_acquire);
+}
+
+size_t circular_buf_read_at(cbuf_handle_t cbuf, uint32_t* position,
+	void* data, size_t len)
+{
+    assert(cbuf && position && data && cbuf->buffer);
+
+    uint32_t pos = *position;
+
+    for(;;)
+    {
+        uint32_t head = atomic_load_explicit(&cbuf->idx->head,
+            memory_order_acquire);
+
+        // more than max behind head the slots may already be reused
+        if((uint32_t)(head - pos) > cbuf->max)
+        {
+            pos = head - cbuf->max;
+        }
+        size_t count = (uint32_t)(head - pos);
+        if(count > len)
+        {
+            count = len;
+        }
+
+        copy_out(cbuf, pos, data, count);
+
+        // Same rule again, the producer may have lapped us while copying.
+        // Head only counts finished writes though: while seq is odd one is
+        // filling up to max slots from head on, which reaches back to what
+        // we copied unless we're that much further from the end.
+        atomic_thread_fence(memory_order_acquire);
+        uint32_t seq = atomic_load_explicit(&cbuf->idx->seq,
+            memory_order_acquire);
+        uint32_t check = atomic_load_explicit(&cbuf->idx->head,
+            memory_order_relaxed);
+        uint32_t limit = (seq & 1) ? cbuf->mask + 1 - cbuf->max : cbuf->max;
+        if((uint32_t)(check - pos) <= limit)
+        {
+            *position = pos + count;
+            return count;
+        }
+        if((uint32_t)(check - pos) > cbuf->max)
+        {
+            pos = check - cbuf->max;
+        }
+        // else wait for the write to finish and look again
+    }
+}
+
+void circular_buf_add_overflows(cbuf_handle_t cbuf, size_t count)
+{
+	assert(cbuf);
+
+	add_overflows(cbuf, count);
+}
+
+size_t circular_buf_overflows(cbuf_handle_t cbuf)
+{
+	assert(cbuf);
+
+	return atomic_load_explicit(&cbuf->idx->overflows, memory_order_relaxed);
 }
 
 bool circular_buf_empty(cbuf_handle_t cbuf)
 {
 	assert(cbuf);
 
-    return (!cbuf->full && (cbuf->head == cbuf->tail));
+    return load_count(cbuf) == 0;
 }
 
 bool circular_buf_full(cbuf_handle_t cbuf)
 {
 	assert(cbuf);
 
-    return cbuf->full;
+    return load_count(cbuf) == cbuf->max;
 }
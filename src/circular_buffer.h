@@ -1,49 +1,122 @@
 #ifndef CIRCULAR_BUFFER_H_
 #define CIRCULAR_BUFFER_H_
 
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 typedef unsigned int storage_t;
 
+/// Indices of a ring, kept apart from the handle so that they can live in
+/// memory shared with other processes. head and tail are free running 32 bit
+/// counters (the slot is counter & (slots - 1)) so that they stay lock-free
+/// on 32 bit boards. seq is odd while the producer is writing a slot and
+/// even otherwise, readers that only look at the data can use it as a
+/// seqlock to take a consistent snapshot
+struct circular_buf_indices {
+	_Alignas(64) _Atomic uint32_t head; //written by the producer only
+	_Atomic uint32_t seq; //written by the producer only
+	_Atomic uint32_t overflows; //values lost, written by the producer only
+	_Alignas(64) _Atomic uint32_t tail;
+};
+
+/// Where circular_buf_peek_span found the buffer's values, oldest first:
+/// first_len of them at first, then second_len more at second (counted in
+/// elements, see circular_buf_init_elements)
+struct circular_buf_span {
+	const void* first;
+	size_t first_len;
+	const void* second;
+	size_t second_len;
+	uint32_t position; //of first[0], for circular_buf_consume
+};
+
 /// Opaque circular buffer structure
 typedef struct circular_buf_t circular_buf_t;
 
 /// Handle type, the way users interact with the API
 typedef circular_buf_t* cbuf_handle_t;
 
+/// Number of elements the buffer handed to circular_buf_init needs to hold
+/// for a capacity of size elements, always a power of two > size
+size_t circular_buf_slots(size_t size);
+
 /// Pass in a storage buffer and size, returns a circular buffer handle
-/// Requires: buffer is not NULL, size > 0
+/// The buffer is a lock-free single producer / single consumer ring: put and
+/// put2 may run concurrently with get, peek and reset without any locking
+/// Requires: buffer is not NULL and holds circular_buf_slots(size) elements,
+/// size > 0
 /// Ensures: cbuf has been created and is returned in an empty state
 cbuf_handle_t circular_buf_init(storage_t* buffer, size_t size);
 
+/// As circular_buf_init, for elements of element_size bytes each rather
+/// than a storage_t. Every data pointer passed to the functions below then
+/// points at element_size bytes per element, and counts are in elements
+/// put and put2 only work on rings of storage_t elements, use put_range and
+/// put_range2 otherwise
+/// Requires: as circular_buf_init, buffer holds circular_buf_slots(size) *
+/// element_size bytes suitably aligned, element_size > 0
+cbuf_handle_t circular_buf_init_elements(void* buffer, size_t size,
+	size_t element_size);
+
+/// As circular_buf_init_elements, but keep head and tail in caller provided
+/// memory, e.g. a shared memory region other processes can read the ring from
+/// Requires: as circular_buf_init_elements, indices is not NULL
+/// Ensures: indices are zeroed, cbuf is returned in an empty state
+cbuf_handle_t circular_buf_init_shared(void* buffer, size_t size,
+	size_t element_size, struct circular_buf_indices* indices);
+
 /// Free a circular buffer structure
 /// Requires: cbuf is valid and created by circular_buf_init
 /// Does not free data buffer; owner is responsible for that
 void circular_buf_free(cbuf_handle_t cbuf);
 
 /// Reset the circular buffer to empty, head == tail. Data not cleared
+/// Consumer side, safe against a concurrent producer
 /// Requires: cbuf is valid and created by circular_buf_init
 void circular_buf_reset(cbuf_handle_t cbuf);
 
 /// Put version 1 continues to add data if the buffer is full
 /// Old data is overwritten
-/// Requires: cbuf is valid and created by circular_buf_init
+/// Requires: cbuf is valid and created by circular_buf_init, elements are
+/// storage_t
 void circular_buf_put(cbuf_handle_t cbuf, storage_t data);
 
 /// Put Version 2 rejects new data if the buffer is full
-/// Requires: cbuf is valid and created by circular_buf_init
+/// Rejected data counts as an overflow
+/// Requires: cbuf is valid and created by circular_buf_init, elements are
+/// storage_t
 /// Returns 0 on success, -1 if buffer is full
 int circular_buf_put2(cbuf_handle_t cbuf, storage_t data);
 
+/// Put up to len values in one go, oldest first, as if put one by one with
+/// circular_buf_put: the oldest values make room if the buffer fills up,
+/// and only the newest capacity values are kept if len is larger than that
+/// The values become visible to consumers together
+/// Requires: cbuf is valid and created by circular_buf_init
+/// Returns the number of values stored, min(len, capacity)
+size_t circular_buf_put_range(cbuf_handle_t cbuf, const void* data,
+	size_t len);
+
+/// Put up to len values in one go like circular_buf_put2: as many as there
+/// is room for are stored, the rest are rejected and count as overflows
+/// Requires: cbuf is valid and created by circular_buf_init
+/// Returns the number of values stored, the first that many of data
+size_t circular_buf_put_range2(cbuf_handle_t cbuf, const void* data,
+	size_t len);
+
 /// Retrieve a value from the buffer
 /// Requires: cbuf is valid and created by circular_buf_init
-/// Returns 0 on success, -1 if the buffer is empty
-int circular_buf_get(cbuf_handle_t cbuf, storage_t* data);
+/// Returns 0 on success, -1 if the buffer is empty (data may have been
+/// written to all the same)
+int circular_buf_get(cbuf_handle_t cbuf, void* data);
 
 /// Retrieve a value from the buffer without removing it
 /// Requires: cbuf is valid and created by circular_buf_init
-/// Returns 0 on success, -1 if the buffer is empty
-int circular_buf_peek(cbuf_handle_t cbuf, int index, storage_t* data);
+/// Returns 0 on success, -1 if the buffer is empty (data may have been
+/// written to all the same)
+int circular_buf_peek(cbuf_handle_t cbuf, int index, void* data);
 
 /// CHecks if the buffer is empty
 /// Requires: cbuf is valid and created by circular_buf_init
@@ -60,12 +133,66 @@ bool circular_buf_full(cbuf_handle_t cbuf);
 /// Returns the maximum capacity of the buffer
 size_t circular_buf_capacity(cbuf_handle_t cbuf);
 
+/// Check the size of the buffer's elements
+/// Requires: cbuf is valid and created by circular_buf_init
+/// Returns the number of bytes per element
+size_t circular_buf_element_size(cbuf_handle_t cbuf);
+
 /// Check the number of elements stored in the buffer
 /// Requires: cbuf is valid and created by circular_buf_init
 /// Returns the current number of elements in the buffer
 size_t circular_buf_size(cbuf_handle_t cbuf);
 
-//TODO: int circular_buf_get_range(circular_buf_t cbuf, uint8_t *data, size_t len);
-//TODO: int circular_buf_put_range(circular_buf_t cbuf, uint8_t * data, size_t len);
+/// Retrieve up to len values from the buffer in one go, oldest first
+/// The values are removed atomically, a concurrent producer or consumer
+/// never sees only part of the range taken. Copied with at most two memcpy
+/// Requires: cbuf is valid and created by circular_buf_init
+/// Returns the number of values copied into data, 0 if the buffer is empty
+size_t circular_buf_get_range(cbuf_handle_t cbuf, void* data, size_t len);
+
+/// Point span at up to len of the oldest values without copying or
+/// removing them. The producer may overwrite them when the buffer is full,
+/// so whatever the caller derives from the span only counts once
+/// circular_buf_consume has succeeded
+/// Requires: cbuf is valid and created by circular_buf_init
+/// Returns the number of values in the span, 0 if the buffer is empty
+size_t circular_buf_peek_span(cbuf_handle_t cbuf,
+	struct circular_buf_span* span, size_t len);
+
+/// Remove the first count values of span from the buffer
+/// Requires: cbuf is valid, span was filled in by circular_buf_peek_span on
+/// it and count is at most the number of values in span
+/// Returns 0 on success, -1 if the values were taken or overwritten in the
+/// meantime, in which case nothing is removed and the span is stale
+int circular_buf_consume(cbuf_handle_t cbuf,
+	const struct circular_buf_span* span, size_t count);
+
+/// Position the next value put stores will get, a free running counter
+/// Readers that keep their own position start here to see only what is put
+/// from now on, see circular_buf_read_at
+/// Requires: cbuf is valid and created by circular_buf_init
+uint32_t circular_buf_head(cbuf_handle_t cbuf);
+
+/// Copy up to len values starting at *position without removing them, so
+/// that any number of readers can follow the ring next to its consumer
+/// Values whose slots the producer has reused already are skipped
+/// Requires: cbuf is valid and created by circular_buf_init, position is a
+/// value circular_buf_head or this function returned
+/// Returns the number of values copied into data, *position is advanced past
+/// them and anything skipped
+size_t circular_buf_read_at(cbuf_handle_t cbuf, uint32_t* position,
+	void* data, size_t len);
+
+/// Count the values lost to a full buffer, pushed out by put or rejected by
+/// put2. Only ever goes up, circular_buf_reset leaves it alone
+/// Requires: cbuf is valid and created by circular_buf_init
+/// Returns the number of values lost since circular_buf_init
+size_t circular_buf_overflows(cbuf_handle_t cbuf);
+
+/// Count values the producer chose not to put, or removed to make room
+/// itself, as overflows
+/// Producer side only
+/// Requires: cbuf is valid and created by circular_buf_init
+void circular_buf_add_overflows(cbuf_handle_t cbuf, size_t count);
 
 #endif //CIRCULAR_BUFFER_H_
@@ -20,48 +20,110 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+// pthread_setaffinity_np()
+#define _GNU_SOURCE
 #include "libgpiod_pulsein.h"
 #include "circular_buffer.h"
+#include "pulsein_compact.h"
+#include "pulsein_ipc.h"
+#include "pulsein_shm.h"
+#include <endian.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
 #include <pthread.h>
 #include <sched.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/msg.h>
-#include <sys/time.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <unistd.h>
 
 #define VMSG_MAXSIZE 4096
+// a width takes at most 10 digits plus a separator in ASCII replies
+#define WIDTH_TEXT_MAX 11
+// a record "<start_ns> <width> <flags>" 20 + 10 + 10 digits, two spaces and
+// a separator
+#define RECORD_TEXT_MAX 43
+// a binary reply holds a header and the pulses, see reply_max_pulses()
+#define BINARY_MAX_WORDS                                                       \
+  ((VMSG_MAXSIZE - sizeof(struct pulsein_binary_header)) / sizeof(storage_t))
+// print_pulses() formats this many at a time
+#define PRINT_CHUNK_PULSES 256
+// stack every thread we start faults in up front
+#define STACK_PREFAULT_SIZE (64 * 1024)
+// how many kernel edge events we pull out of the line fd per read
+#define EVENT_BATCH_SIZE 16
+// trigger pulses spin rather than sleep for this long before their end
+#define TRIGGER_SPIN_NS 200000
+// a paused capture thread wakes up this often to look for SIGINT
+#define PAUSE_WAKE_NS 100000000
+// upper bound on how long the event thread sleeps holding the line
+#define EVENT_WAIT_TIMEOUT_NS 10000000
+// slow mode times this many ticks to recalibrate ns_per_tick
+#define RECALIBRATE_TICKS 10000
 struct vmsgbuf {
   long msg_type;
   char message[VMSG_MAXSIZE];
 };
 
-unsigned int pulses[MAX_PULSE_BUFFER] = {0};
+// One per offset given on the command line, in that order
+struct pulse_channel channels[MAX_LINES];
+unsigned int num_channels = 0;
+struct capture_stats stats;
 
 // Accessed by multiple threads with explicit synchronization
-cbuf_handle_t ringbuffer;
-pthread_mutex_t ringbuffer_mtx;
-struct gpiod_line *line;
+// (backend calls)
+const struct pulsein_backend *backend = &gpiod_backend;
 pthread_mutex_t line_mtx;
-volatile bool was_paused = false;
-pthread_mutex_t barrier;
+// trigger pulses waiting for line_mtx, the capture threads stand back
+atomic_int line_waiters = 0;
+// paused and was_paused are guarded by pause_mtx, the capture threads wait on
+// pause_cond while paused
+pthread_mutex_t pause_mtx;
+pthread_cond_t pause_cond;
+bool was_paused = false;
+// set by sig_handler() in the capture thread, the only one taking SIGINT
+volatile sig_atomic_t interrupted = 0;
+// 'w' commands sleep on wait_cond until notify_waiter() wakes them
+pthread_mutex_t wait_mtx;
+pthread_cond_t wait_cond;
 
-#if defined(FOLLOW_PULSE)
-struct gpiod_line *line2;
-#endif
-
-int offset;
-float us_per_tick = 0;
-int32_t timeout_microseconds = 0;
+double ns_per_tick = 0;
+// what calculate_ns_per_tick() measured at startup, slow mode recalibrates
+// ns_per_tick as it goes and reports the drift from this
+double calibrated_ns_per_tick = 0;
+int64_t timeout_ns = 0;
+// --sample-period, 0 to poll as fast as we can
+int64_t sample_period_ns = 0;
+// --idle-sleep, 0 to poll even when nothing happens
+int64_t idle_sleep_ns = 0;
+// /dev/cpu_dma_latency while capture is running, -1 otherwise
+int latency_qos_fd = -1;
 bool idle_state = false, fast_linux = true, exit_on_timeout = false,
-     paused = false;
+     paused = false, edge_events = false, nanosecond_widths = false,
+     huge_pages = false, pulse_records = false, compact_widths = false;
+// storage_t per pulse in the rings, PULSEIN_RECORD_WORDS with --records
+size_t pulse_words = 1;
+enum overflow_policy overflow_policy = OVERFLOW_OVERWRITE;
+struct thread_placement capture_placement = {-1, -1}, ipc_placement = {-1, -1};
 
-const char *consumername = "libgpiod_pulsein";
+// options without a short form
+enum {
+  OPT_CAPTURE_CPU = 256,
+  OPT_IPC_CPU,
+  OPT_CAPTURE_PRIO,
+  OPT_IPC_PRIO,
+  OPT_SAMPLE_PERIOD,
+  OPT_IDLE_SLEEP,
+};
 
 static const struct option longopts[] = {
     {"help", no_argument, NULL, 'h'},
@@ -72,37 +134,97 @@ static const struct option longopts[] = {
     {"timeout", required_argument, NULL, 't'},
     {"queue", required_argument, NULL, 'q'},
     {"slow", no_argument, NULL, 's'},
+    {"edge-events", no_argument, NULL, 'e'},
+    {"shm", required_argument, NULL, 'm'},
+    {"nanoseconds", no_argument, NULL, 'n'},
+    {"sim", required_argument, NULL, 'S'},
+    {"sim-rate", required_argument, NULL, 'R'},
+    {"socket", required_argument, NULL, 'u'},
+    {"huge-pages", no_argument, NULL, 'H'},
+    {"overflow", required_argument, NULL, 'O'},
+    {"records", no_argument, NULL, 'r'},
+    {"compact", no_argument, NULL, 'c'},
+    {"capture-cpu", required_argument, NULL, OPT_CAPTURE_CPU},
+    {"ipc-cpu", required_argument, NULL, OPT_IPC_CPU},
+    {"capture-prio", required_argument, NULL, OPT_CAPTURE_PRIO},
+    {"ipc-prio", required_argument, NULL, OPT_IPC_PRIO},
+    {"sample-period", required_argument, NULL, OPT_SAMPLE_PERIOD},
+    {"idle-sleep", required_argument, NULL, OPT_IDLE_SLEEP},
+    {NULL, 0, NULL, 0},
 };
 
-static const char *const shortopts = "+hviptd";
+static const char *const shortopts = "+hvisenHrcp:t:d:q:m:S:R:u:O:";
 
 static void print_help(void) {
-  printf("Usage: libgpiod_pulsein [OPTIONS] <chip name/number> <offset>\n");
-  printf("Continuously poll line value from a GPIO chip\n");
+  printf("Usage: libgpiod_pulsein [OPTIONS] <chip name/number> <offset> "
+         "[<offset>...]\n");
+  printf("Continuously poll line values from a GPIO chip\n");
   printf("\n");
   printf("Options:\n");
   printf("  -h, --help:\t\tdisplay this message and exit\n");
   printf("  -v, --version:\tdisplay the version and exit\n");
   printf(
       "  -i, --idle_state:\tset the line idle state to HIGH (defalt is low)\n");
-  printf("  -p, --pulses:\tnumber of pulses to store in ring buffer\n");
+  printf("  -p, --pulses:\tnumber of pulses to store in ring buffer "
+         "(default %d)\n",
+         DEFAULT_PULSE_BUFFER);
+  printf("  -O, --overflow:\tWhat to do with a pulse when the ring buffer "
+         "is full:\noverwrite the oldest (default), drop the new one, or "
+         "drop it and pause\nuntil resumed (overwrite|drop|pause)\n");
+  printf("  -H, --huge-pages:\tBack the ring buffers with huge pages when "
+         "available\n(not with --shm)\n");
   printf("  -t, --timeout:\tnumber microseconds to wait before exit\n");
-  printf("  -d, --trigger:\tSend an initial output pulse of n microseconds\n");
+  printf("  -d, --trigger:\tSend an initial output pulse of n microseconds "
+         "on the first line\n");
   printf("  -q, --queue:\tID number of SYSV queue for IPC\n");
   printf("  -s, --slow:\tWe're running on a slow linux machine,\ntry to "
          "calibrate us-per-tick - values may not be true us\n");
+  printf("      --sample-period:\tRead the lines every n microseconds "
+         "rather than as fast\nas possible, sleeping in between. Widths "
+         "are whole periods, counted\nrather than timed\n");
+  printf("      --idle-sleep:\tOnce every line has been quiet this many "
+         "microseconds,\nstop polling and sleep on kernel edge events until "
+         "the next edge\n");
+  printf("  -e, --edge-events:\tDon't poll, sleep on kernel edge events and "
+         "use\ntheir timestamps for pulse widths\n");
+  printf("  -n, --nanoseconds:\tStore pulse widths in nanoseconds rather than "
+         "microseconds\n(widths saturate at ~4.29s)\n");
+  printf("  -r, --records:\tStore each pulse with its start time and level, "
+         "see\nstruct pulsein_record, rather than just its width\n");
+  printf("  -c, --compact:\tStore widths in 16 bit codes, so short pulses "
+         "take half\nthe room, -p then counts codes (a width of 32768 or "
+         "more takes\ntwo or three, see pulsein_compact.h)\n");
+  printf("  -m, --shm:\tPublish the ring buffer in this POSIX shared memory "
+         "object\nfor zero-copy readers, see pulsein_shm.h (<name>.<offset> "
+         "per line\nwhen capturing more than one)\n");
+  printf("  -u, --socket:\tServe the same commands as the message queue on "
+         "this Unix\nsocket, one per line, to any number of clients\n");
+  printf("      --capture-cpu:\tRun the capture thread on this CPU only, an "
+         "isolated one\nideally (isolcpus=)\n");
+  printf("      --ipc-cpu:\tRun the queue and socket threads on this CPU "
+         "only\n");
+  printf("      --capture-prio:\tSCHED_FIFO priority of the capture thread, "
+         "0 for normal\nscheduling (default the highest)\n");
+  printf("      --ipc-prio:\tThe same for the queue and socket threads\n");
+  printf("  -S, --sim:\tDon't touch GPIO, replay this comma separated list "
+         "of pulse\nwidths in microseconds on every line instead\n");
+  printf("  -R, --sim-rate:\tDon't touch GPIO, replay a square wave with "
+         "this many\nedges per second on every line instead\n");
 }
 
 int main(int argc, char **argv) {
   int optc, opti;
-  int max_pulses = MAX_PULSE_BUFFER;
+  unsigned long max_pulses = DEFAULT_PULSE_BUFFER;
   int32_t trigger_len_us = 0;
   bool trigger_pulse = false;
-  char *device, *end;
-  struct gpiod_chip *chip = NULL;
+  char *device, *end, *shm_name = NULL, *sim_widths = NULL;
+  unsigned long sim_rate = 0;
+  unsigned int offsets[MAX_LINES];
   struct vmsgbuf vmbuf;
   int queue_id = 0, queue_key = 0;
-  pthread_t polling_thread;
+  struct ipc_session queue_session = {.queue_id = -1, .fd = -1};
+  char *socket_path = NULL;
+  pthread_t polling_thread, queue_thread;
 
   for (;;) {
     optc = getopt_long(argc, argv, shortopts, longopts, &opti);
@@ -122,9 +244,50 @@ int main(int argc, char **argv) {
     case 's':
       fast_linux = false;
       break;
+    case 'e':
+      edge_events = true;
+      break;
+    case 'm':
+      shm_name = optarg;
+      break;
+    case 'n':
+      nanosecond_widths = true;
+      break;
+    case 'H':
+      huge_pages = true;
+      break;
+    case 'r':
+      pulse_records = true;
+      pulse_words = PULSEIN_RECORD_WORDS;
+      break;
+    case 'c':
+      compact_widths = true;
+      break;
+    case 'O':
+      if (strcmp(optarg, "overwrite") == 0) {
+        overflow_policy = OVERFLOW_OVERWRITE;
+      } else if (strcmp(optarg, "drop") == 0) {
+        overflow_policy = OVERFLOW_DROP;
+      } else if (strcmp(optarg, "pause") == 0) {
+        overflow_policy = OVERFLOW_PAUSE;
+      } else {
+        printf("invalid overflow policy: %s", optarg);
+        exit(1);
+      }
+      break;
+    case 'S':
+      sim_widths = optarg;
+      break;
+    case 'R':
+      sim_rate = strtoul(optarg, &end, 10);
+      if (*end != '\0' || sim_rate == 0) {
+        printf("invalid simulated edge rate: %s", optarg);
+        exit(1);
+      }
+      break;
     case 'p':
       max_pulses = strtoul(optarg, &end, 10);
-      if (*end != '\0' || max_pulses > INT_MAX) {
+      if (*end != '\0' || max_pulses == 0 || max_pulses > MAX_PULSE_BUFFER) {
         printf("invalid max pulse count: %s", optarg);
         exit(1);
       }
@@ -139,11 +302,61 @@ int main(int argc, char **argv) {
       break;
     case 't':
       exit_on_timeout = true;
-      timeout_microseconds = strtoul(optarg, &end, 10);
-      if (*end != '\0' || timeout_microseconds > INT_MAX) {
+      timeout_ns = strtoul(optarg, &end, 10);
+      if (*end != '\0' || timeout_ns > INT_MAX) {
         printf("invalid timeout: %s", optarg);
         exit(1);
       }
+      timeout_ns *= 1000;
+      break;
+    case 'u':
+      socket_path = optarg;
+      break;
+    case OPT_CAPTURE_CPU:
+    case OPT_IPC_CPU: {
+      long cpu = strtol(optarg, &end, 10);
+      if (*end != '\0' || cpu < 0 || cpu >= CPU_SETSIZE) {
+        printf("invalid CPU: %s", optarg);
+        exit(1);
+      }
+      if (optc == OPT_CAPTURE_CPU) {
+        capture_placement.cpu = cpu;
+      } else {
+        ipc_placement.cpu = cpu;
+      }
+      break;
+    }
+    case OPT_CAPTURE_PRIO:
+    case OPT_IPC_PRIO: {
+      long priority = strtol(optarg, &end, 10);
+      if (*end != '\0' || priority < 0 ||
+          priority > sched_get_priority_max(SCHED_FIFO)) {
+        printf("invalid priority: %s", optarg);
+        exit(1);
+      }
+      if (optc == OPT_CAPTURE_PRIO) {
+        capture_placement.priority = priority;
+      } else {
+        ipc_placement.priority = priority;
+      }
+      break;
+    }
+    case OPT_SAMPLE_PERIOD:
+      sample_period_ns = strtoul(optarg, &end, 10);
+      if (*end != '\0' || sample_period_ns == 0 ||
+          sample_period_ns > INT_MAX) {
+        printf("invalid sample period: %s", optarg);
+        exit(1);
+      }
+      sample_period_ns *= 1000;
+      break;
+    case OPT_IDLE_SLEEP:
+      idle_sleep_ns = strtoul(optarg, &end, 10);
+      if (*end != '\0' || idle_sleep_ns == 0 || idle_sleep_ns > INT_MAX) {
+        printf("invalid idle sleep: %s", optarg);
+        exit(1);
+      }
+      idle_sleep_ns *= 1000;
       break;
     case 'q':
       queue_key = strtoul(optarg, &end, 10);
@@ -167,19 +380,91 @@ int main(int argc, char **argv) {
   }
 
   if (argc < 2) {
-    printf("a single GPIO line offset must be specified\n");
+    printf("at least one GPIO line offset must be specified\n");
     print_help();
     exit(1);
   }
 
-  device = argv[0];
-  offset = strtoul(argv[1], &end, 10);
-  if (*end != '\0' || offset > INT_MAX) {
-    printf("invalid GPIO offset: %s", argv[1]);
+  if (argc - 1 > MAX_LINES) {
+    printf("at most %d GPIO lines can be captured\n", MAX_LINES);
+    exit(1);
+  }
+
+  if (sample_period_ns && edge_events) {
+    printf("--sample-period polls, it can't go with --edge-events\n");
     exit(1);
   }
 
-  if (signal(SIGINT, sig_handler) == SIG_ERR) {
+  if (sample_period_ns) {
+    // slow mode's tick counting, with ticks that are exactly a period
+    fast_linux = false;
+    ns_per_tick = sample_period_ns;
+  }
+
+  if (idle_sleep_ns && !fast_linux) {
+    // slow mode counts reads, sleeping would stop its clock
+    printf("--idle-sleep needs polling as fast as we can, it can't go with "
+           "--slow or\n--sample-period\n");
+    exit(1);
+  }
+
+  if (idle_sleep_ns && edge_events) {
+    printf("--idle-sleep polls, it can't go with --edge-events\n");
+    exit(1);
+  }
+
+  if (compact_widths && pulse_records) {
+    printf("--compact stores bare widths, it can't go with --records\n");
+    exit(1);
+  }
+
+  if (compact_widths && (max_pulses < COMPACT_CODES_MAX)) {
+    // room for at least the longest width
+    printf("--compact needs at least %d pulses\n", COMPACT_CODES_MAX);
+    exit(1);
+  }
+
+  // the ring storage, plus the header with --shm, has to fit a size_t, a
+  // big -p can overflow it on 32 bit boards
+  if (circular_buf_slots(max_pulses) >
+      (SIZE_MAX - sizeof(struct pulsein_shm)) / ring_element_size()) {
+    printf("%lu pulses take more memory than we can address\n", max_pulses);
+    exit(1);
+  }
+
+  device = argv[0];
+  num_channels = argc - 1;
+  for (unsigned int i = 0; i < num_channels; i++) {
+    unsigned long offset = strtoul(argv[i + 1], &end, 10);
+    if (*end != '\0' || offset > INT_MAX) {
+      printf("invalid GPIO offset: %s", argv[i + 1]);
+      exit(1);
+    }
+    channels[i].offset = offsets[i] = offset;
+  }
+
+  if (sim_widths || sim_rate) {
+    if (sim_backend_configure(sim_widths, sim_rate, idle_state) != 0) {
+      if (sim_widths) {
+        printf("invalid simulated pulse train: %s\n", sim_widths);
+      } else {
+        // more than one edge per nanosecond
+        printf("invalid simulated edge rate: %lu\n", sim_rate);
+      }
+      exit(1);
+    }
+    backend = &sim_backend;
+  }
+
+  // SIGINT goes to the capture thread alone, see accept_interrupts(), the
+  // other threads we start inherit it blocked. At SCHED_FIFO it may well
+  // never leave the CPU to anyone else to take it.
+  struct sigaction action = {.sa_handler = sig_handler};
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  if ((sigaction(SIGINT, &action, NULL) != 0) ||
+      (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0)) {
     printf("Can't catch SIGINT\n");
     exit(1);
   }
@@ -187,15 +472,12 @@ int main(int argc, char **argv) {
   // Bump up process priority and change scheduler to try
   // to make process more 'real time'.
   set_max_priority();
+  lock_all_memory();
 
-  chip = gpiod_chip_open_by_name(device);
-  if (!chip) {
-    printf("Unable to open chip: %s\n", device);
-    exit(1);
-  }
-  line = gpiod_chip_get_line(chip, offset);
-  if (!line) {
-    printf("Unable to open line: %d\n", offset);
+  // claim the lines as inputs, --idle-sleep reads them but sleeps on their
+  // edges too
+  if (backend->open(device, offsets, num_channels,
+                    edge_events || idle_sleep_ns) != 0) {
     exit(1);
   }
 
@@ -215,174 +497,826 @@ int main(int argc, char **argv) {
     vmbuf.message[0] = '!';
     vmbuf.msg_type = 2;
     msgsnd(queue_id, (struct msgbuf *)&vmbuf, 1, 0);
+    queue_session.queue_id = queue_id;
   }
 
-  if (!fast_linux && us_per_tick == 0) {
-    us_per_tick = calculate_us_per_tick(line);
-  }
-
-#if defined(FOLLOW_PULSE)
-  // Helpful for debugging where we do our reads on a scope
-  line2 = gpiod_chip_get_line(chip, FOLLOW_PULSE);
-  if (!line2) {
-    printf("Unable to open line: %d\n", FOLLOW_PULSE);
-    exit(1);
-  }
-  gpiod_line_release(line2);
-  if (gpiod_line_request_output(line2, consumername, 0) != 0) {
-    printf("Unable to set line %d to output\n", FOLLOW_PULSE);
-    exit(1);
-  }
-#endif
-
-  // set to an input
-  if (gpiod_line_request_input(line, consumername) != 0) {
-    printf("Unable to set line %d to input\n", offset);
-    exit(1);
+  if (!edge_events && !fast_linux && ns_per_tick == 0) {
+    calibrated_ns_per_tick = ns_per_tick = calculate_ns_per_tick();
   }
 
+  // capture starts running below, keep the CPUs awake until it's paused
+  latency_qos_hold();
   if (trigger_pulse) {
-    pulse_output(line, idle_state, trigger_len_us);
+    pulse_output(0, idle_state, trigger_len_us);
   }
 
-  // a simple ring buffer
-  ringbuffer = circular_buf_init(pulses, max_pulses);
-  circular_buf_reset(ringbuffer);
+  // a simple ring buffer per line, optionally readable by other processes
+  for (unsigned int i = 0; i < num_channels; i++) {
+    if (shm_name && num_channels == 1) {
+      channels[i].ringbuffer = create_shared_ringbuffer(shm_name, max_pulses);
+    } else if (shm_name) {
+      char channel_shm_name[NAME_MAX];
+      snprintf(channel_shm_name, sizeof(channel_shm_name), "%s.%u", shm_name,
+               channels[i].offset);
+      channels[i].ringbuffer =
+          create_shared_ringbuffer(channel_shm_name, max_pulses);
+    } else {
+      channels[i].ringbuffer =
+          circular_buf_init_elements(allocate_pulse_storage(max_pulses),
+                                     max_pulses, ring_element_size());
+    }
+    circular_buf_reset(channels[i].ringbuffer);
+  }
 
   // initialize mutexes
-  pthread_mutex_init(&ringbuffer_mtx, NULL);
   pthread_mutex_init(&line_mtx, NULL);
-  pthread_mutex_init(&barrier, NULL);
+  pthread_mutex_init(&pause_mtx, NULL);
+  pthread_mutex_init(&wait_mtx, NULL);
+  // 'w' deadlines and pause wakeups come from monotonic_ns()
+  pthread_condattr_t wait_cond_attr;
+  pthread_condattr_init(&wait_cond_attr);
+  pthread_condattr_setclock(&wait_cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&pause_cond, &wait_cond_attr);
+  pthread_cond_init(&wait_cond, &wait_cond_attr);
+  pthread_condattr_destroy(&wait_cond_attr);
 
   // Spawn thread for sensor polling
-  pthread_create(&polling_thread, NULL, polling_thread_runner, NULL);
+  pthread_create(&polling_thread, NULL,
+                 edge_events ? event_thread_runner : polling_thread_runner,
+                 NULL);
 
-  for (;;) {
-    if (queue_key != 0) {
-      vmbuf.msg_type = 1;
-      int msglen =
-          msgrcv(queue_id, (struct msgbuf *)&vmbuf, VMSG_MAXSIZE - 1, 1, 0);
-      if (msglen == -1) {
-        if (errno == EINVAL) {
-          // queue_id is invalid, i.e., the message queue has been destroyed.
-          // There is no way to recover from this.
-          fprintf(stderr, "Lost access to message queue\n");
-          exit(EXIT_FAILURE);
-        }
-      }
-      if (msglen >= 1) {
-        vmbuf.message[msglen] = 0; // null terminate message to keep neat
-
-        // printf("got %d byte message: %s\n", msglen, vmbuf.message);
-        char cmd = vmbuf.message[0];
-        if (cmd == 'p') {
-          // pause
-          if (!paused) {
-            pthread_mutex_lock(&barrier);
-            paused = true;
-            was_paused = true;
-          }
-        } else if (cmd == 'r') {
-          // resume
-          if (paused) {
-            paused = false;
-            pthread_mutex_unlock(&barrier);
-          }
-        } else if (cmd == 'c') {
-          // clear
-          pthread_mutex_lock(&ringbuffer_mtx);
-          circular_buf_reset(ringbuffer);
-          pthread_mutex_unlock(&ringbuffer_mtx);
-        } else if (cmd == 'l') {
-          // send back length
-          pthread_mutex_lock(&ringbuffer_mtx);
-          int buflen = circular_buf_size(ringbuffer);
-          pthread_mutex_unlock(&ringbuffer_mtx);
-          snprintf(vmbuf.message, 15, "%d", buflen);
-          vmbuf.msg_type = 2;
-          msgsnd(queue_id, (struct msgbuf *)&vmbuf, strlen(vmbuf.message), 0);
-        } else if (cmd == 't') {
-          // Resume with trigger pulse!
-          if (paused) {
-            paused = false;
-            pthread_mutex_unlock(&barrier);
-            unsigned int trigger_len = strtoul(vmbuf.message + 1, NULL, 10);
-            // printf("trigger %d\n", trigger_len);
-
-            // Keep CPU busy for a while to make sure it's not sleeping and
-            // clocked high.
-            busy_wait_milliseconds(80);
-            while (pthread_mutex_trylock(&line_mtx) != 0)
-              ;
-            pulse_output(line, idle_state, trigger_len);
-            pthread_mutex_unlock(&line_mtx);
-          }
-        } else if (cmd == '^') {
-          // pop one message off and send it
-          unsigned int pulse;
-          pthread_mutex_lock(&ringbuffer_mtx);
-          int ret = circular_buf_get(ringbuffer, &pulse);
-          pthread_mutex_unlock(&ringbuffer_mtx);
-          if (ret == -1) {
-            pulse = -1;
-          }
-          snprintf(vmbuf.message, 15, "%d", pulse);
-          vmbuf.msg_type = 2;
-          msgsnd(queue_id, (struct msgbuf *)&vmbuf, strlen(vmbuf.message), 0);
-        } else if (cmd == 'i') {
-          // query one element by index #
-          int index = strtol(vmbuf.message + 1, NULL, 10);
-          pthread_mutex_lock(&ringbuffer_mtx);
-          int buf_len = circular_buf_size(ringbuffer);
-          pthread_mutex_unlock(&ringbuffer_mtx);
-          unsigned int pulse = 0;
-          if ((index >= buf_len) || (index <= -buf_len)) {
-            pulse = -1; // invalid, we're seeking beyond the buffer
-          } else {
-            if (index < 0) { // back indexing from end
-              index = buf_len + index;
-            }
-            // peek in the queue!
-            pthread_mutex_lock(&ringbuffer_mtx);
-            int ret = circular_buf_peek(ringbuffer, index, &pulse);
-            pthread_mutex_unlock(&ringbuffer_mtx);
-            if (ret == -1) {
-              pulse = -1;
-            }
-          }
-          // OK reply back!
-          snprintf(vmbuf.message, 15, "%d", pulse);
-          vmbuf.msg_type = 2;
-          msgsnd(queue_id, (struct msgbuf *)&vmbuf, strlen(vmbuf.message), 0);
-        }
-      }
-    }
+  if (socket_path && socket_server_start(socket_path) != 0) {
+    exit(1);
+  }
+
+  if (queue_key != 0) {
+    pthread_create(&queue_thread, NULL, queue_thread_runner, &queue_session);
   }
 
+  // Nothing left to do here, the capture thread exits on SIGINT or a
+  // timeout
+  pthread_join(polling_thread, NULL);
   return EXIT_SUCCESS;
 }
 
+// Only notes that SIGINT came, the capture thread looks at interrupted
+// between reads and calls stop_if_interrupted()
 void sig_handler(int signo) {
   if (signo == SIGINT) {
+    interrupted = 1;
+  }
+}
+
+// Capture threads only, takes SIGINT in this thread from now on
+void accept_interrupts(void) {
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+}
+
+// Capture threads only. Dumps what was captured and exits once SIGINT came,
+// capture is stopped as it's this thread that would do it.
+void stop_if_interrupted(void) {
+  if (interrupted) {
     fprintf(stderr, "received SIGINT\n");
     print_pulses();
     exit(EXIT_SUCCESS);
   }
 }
 
-// not thread-safe, expects exclusive access to ringbuffer
-void print_pulses(void) {
-  int pulse_count = circular_buf_size(ringbuffer);
-  for (int i = 0; i < pulse_count; i++) {
-    unsigned int pulse = 0;
-    circular_buf_get(ringbuffer, &pulse);
+// Capture threads only, with pause_mtx held. Blocks as long as we are
+// paused, keeping the CPU idle but for a look for SIGINT now and then.
+void wait_while_paused(void) {
+  while (paused) {
+    stop_if_interrupted();
+    int64_t wake_ns = monotonic_ns() + PAUSE_WAKE_NS;
+    struct timespec wake = {wake_ns / NS_PER_SECOND, wake_ns % NS_PER_SECOND};
+    pthread_cond_timedwait(&pause_cond, &pause_mtx, &wake);
+  }
+  stop_if_interrupted();
+}
+
+// Serves the SysV message queue of the session passed in
+void *queue_thread_runner(void *args) {
+  struct ipc_session *session = args;
+  struct vmsgbuf vmbuf;
+
+  place_thread(&ipc_placement, "queue");
+
+  for (;;) {
+    vmbuf.msg_type = 1;
+    int msglen = msgrcv(session->queue_id, (struct msgbuf *)&vmbuf,
+                        VMSG_MAXSIZE - 1, 1, 0);
+    if (msglen == -1) {
+      if (errno == EINVAL) {
+        // queue_id is invalid, i.e., the message queue has been destroyed.
+        // There is no way to recover from this.
+        fprintf(stderr, "Lost access to message queue\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    if (msglen >= 1) {
+      vmbuf.message[msglen] = 0; // null terminate message to keep neat
 
-    printf("%d", pulse);
-    if (i != pulse_count - 1) {
-      printf(", ");
+      // printf("got %d byte message: %s\n", msglen, vmbuf.message);
+      handle_command(session, vmbuf.message);
     }
   }
-  printf("\n");
+
+  return NULL;
+}
+
+// Runs one command from any IPC client, see pulsein_ipc.h. Called from the
+// SysV loop in main() and from the socket thread, possibly at the same time.
+void handle_command(struct ipc_session *session, char *command) {
+  struct pulse_channel *channel = &channels[0];
+  char reply[24];
+
+  // '@<n>' in front of a command picks the n'th line, default first
+  if (command[0] == '@') {
+    unsigned long index = strtoul(command + 1, &command, 10);
+    if (index >= num_channels) {
+      // no such line, whatever the command it gets exactly this reply
+      send_text_reply(session, "?");
+      return;
+    }
+    channel = &channels[index];
+  }
+  char cmd = command[0];
+  if (cmd == 'p') {
+    // pause
+    pause_capture();
+  } else if (cmd == 'r') {
+    // resume
+    resume_capture();
+  } else if (cmd == 'c') {
+    // clear
+    clear_pulses(channel);
+  } else if (cmd == 'l') {
+    // send back length
+    if (session->binary_replies) {
+      send_binary_reply(session, channel, NULL, 0);
+    } else {
+      snprintf(reply, sizeof(reply), "%d", (int)pulse_count(channel));
+      send_text_reply(session, reply);
+    }
+  } else if (cmd == 'o') {
+    // pulses lost to a full ring buffer since startup, never goes down
+    if (session->binary_replies) {
+      send_binary_reply(session, channel, NULL, 0);
+    } else {
+      snprintf(reply, sizeof(reply), "%zu",
+               circular_buf_overflows(channel->ringbuffer));
+      send_text_reply(session, reply);
+    }
+  } else if (cmd == 'b') {
+    // switch reply format, acknowledged in ASCII so that clients can
+    // tell whether we understood
+    session->binary_replies = (command[1] == '1');
+    send_text_reply(session, session->binary_replies ? "b1" : "b0");
+  } else if (cmd == 't' || cmd == 'T') {
+    // Resume with trigger pulse! 'T' also reports the pulse width we
+    // actually managed in nanoseconds, or -1 if we weren't paused
+    int64_t achieved_ns = -1;
+    // announced before the capture thread wakes up, so that it leaves the
+    // line to us from its first pass rather than sleeping on it
+    atomic_fetch_add(&line_waiters, 1);
+    if (resume_capture()) {
+      unsigned int trigger_len = strtoul(command + 1, NULL, 10);
+      // printf("trigger %d\n", trigger_len);
+
+      while (pthread_mutex_trylock(&line_mtx) != 0) {
+        atomic_fetch_add_explicit(&stats.trigger_spins, 1,
+                                  memory_order_relaxed);
+      }
+      achieved_ns = pulse_output(channel - channels, idle_state, trigger_len);
+      pthread_mutex_unlock(&line_mtx);
+    }
+    atomic_fetch_sub(&line_waiters, 1);
+    if (cmd == 'T') {
+      snprintf(reply, sizeof(reply), "%lld", (long long)achieved_ns);
+      send_text_reply(session, reply);
+    }
+  } else if (cmd == 'S') {
+    // capture statistics, always in ASCII
+    send_stats_reply(session);
+  } else if (cmd == '^') {
+    // pop one message off and send it
+    storage_t pulse[PULSEIN_RECORD_WORDS];
+    size_t count = take_pulses(channel, pulse, 1);
+    send_pulse_reply(session, channel, pulse, count == 1);
+  } else if (cmd == 'd') {
+    // drain as many pulses as fit into one message
+    send_drain_reply(session, channel, strtoul(command + 1, NULL, 10));
+  } else if (cmd == 'w') {
+    // 'w<n>[,<timeout_us>]' replies like 'd<n>' once n pulses are
+    // waiting, or with whatever there is when the timeout runs out
+    char *end;
+    size_t wanted = strtoul(command + 1, &end, 10);
+    int64_t deadline_ns = 0;
+    if (*end == ',') {
+      deadline_ns = monotonic_ns() + strtoll(end + 1, NULL, 10) * 1000LL;
+    }
+    // more than the ring can hold would never come
+    if (wanted > circular_buf_capacity(channel->ringbuffer)) {
+      wanted = circular_buf_capacity(channel->ringbuffer);
+    }
+    if (wanted == 0) {
+      // nothing to wait for, and 0 would disarm the other waiters
+      send_drain_reply(session, channel, 0);
+      return;
+    }
+    if (session->fd >= 0) {
+      // the socket thread serves other clients meanwhile and replies later
+      session->wait_channel = channel;
+      session->wait_count = wanted;
+      session->wait_deadline_ns = deadline_ns;
+      return;
+    }
+    wait_for_pulses(channel, wanted, deadline_ns);
+    send_drain_reply(session, channel, wanted);
+  } else if (cmd == 's') {
+    // 's<batch>[,<delay_us>]' subscribes to the line until 'u': its pulses
+    // are pushed from now on, batch at a time or after delay_us at most
+    if (session->fd < 0) {
+      // a queue has nowhere to push to
+      send_text_reply(session, "s0");
+      return;
+    }
+    char *end;
+    size_t batch = strtoul(command + 1, &end, 10);
+    int64_t delay_us = (*end == ',') ? strtoll(end + 1, NULL, 10) : 0;
+    // ASCII replies hold fewer than binary ones, and 'b' may still come
+    if ((batch == 0) || (batch > reply_max_pulses(false))) {
+      batch = reply_max_pulses(false);
+    }
+    session->sub_channel = channel;
+    session->sub_position = circular_buf_head(channel->ringbuffer);
+    session->sub_batch = batch;
+    session->sub_delay_ns = delay_us > 0 ? delay_us * 1000 : 0;
+    session->sub_deadline_ns = 0;
+    snprintf(reply, sizeof(reply), "s%zu", batch);
+    send_text_reply(session, reply);
+  } else if (cmd == 'u') {
+    // unsubscribe
+    session->sub_channel = NULL;
+    send_text_reply(session, "u");
+  } else if (cmd == 'i') {
+    // query one element by index #
+    int index = strtol(command + 1, NULL, 10);
+    int buf_len = pulse_count(channel);
+    storage_t pulse[PULSEIN_RECORD_WORDS];
+    bool found = false;
+    // out of range means we're seeking beyond the buffer
+    if ((index < buf_len) && (index > -buf_len)) {
+      if (index < 0) { // back indexing from end
+        index = buf_len + index;
+      }
+      // peek in the queue!
+      found = peek_pulse(channel, index, pulse);
+    }
+    // OK reply back!
+    send_pulse_reply(session, channel, pulse, found);
+  }
+}
+
+// Stops the capture thread at the top of its loop. Any IPC thread may pause
+// and resume.
+void pause_capture(void) {
+  pthread_mutex_lock(&pause_mtx);
+  if (!paused) {
+    paused = true;
+    was_paused = true;
+    latency_qos_release();
+  }
+  pthread_mutex_unlock(&pause_mtx);
+}
+
+// returns whether capture was paused
+bool resume_capture(void) {
+  bool resumed = false;
+  pthread_mutex_lock(&pause_mtx);
+  if (paused) {
+    latency_qos_hold();
+    paused = false;
+    resumed = true;
+    pthread_cond_broadcast(&pause_cond);
+  }
+  pthread_mutex_unlock(&pause_mtx);
+  return resumed;
+}
+
+// Gathers iov into one reply message for the SysV queue, or hands it to the
+// session's socket
+void send_reply(struct ipc_session *session, const struct iovec *iov,
+                int iovcnt) {
+  if (session->fd >= 0) {
+    socket_send(session, iov, iovcnt);
+    return;
+  }
+
+  struct vmsgbuf vmbuf;
+  size_t msgpos = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    memcpy(vmbuf.message + msgpos, iov[i].iov_base, iov[i].iov_len);
+    msgpos += iov[i].iov_len;
+  }
+  vmbuf.msg_type = 2;
+  msgsnd(session->queue_id, (struct msgbuf *)&vmbuf, msgpos, 0);
+}
+
+// sockets need the '\n' to tell where the reply ends
+void send_text_reply(struct ipc_session *session, const char *text) {
+  struct iovec iov[2] = {{(void *)text, strlen(text)}, {"\n", 1}};
+  send_reply(session, iov, session->fd >= 0 ? 2 : 1);
+}
+
+// Creates the --shm object, see pulsein_shm.h for the layout. The object is
+// left behind on exit so that readers can still pick up the last capture.
+cbuf_handle_t create_shared_ringbuffer(const char *name, size_t max_pulses) {
+  size_t slots = circular_buf_slots(max_pulses);
+  // cache line aligned thanks to the indices, so the pulses are too
+  size_t header_size = sizeof(struct pulsein_shm);
+  size_t total_size = header_size + slots * ring_element_size();
+
+  // start from scratch, a stale object may have a different size
+  shm_unlink(name);
+  int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd == -1) {
+    printf("Unable to create shared memory %s: %s\n", name, strerror(errno));
+    exit(1);
+  }
+  if (ftruncate(fd, total_size) != 0) {
+    printf("Unable to size shared memory %s: %s\n", name, strerror(errno));
+    exit(1);
+  }
+  struct pulsein_shm *shm =
+      mmap(NULL, total_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (shm == MAP_FAILED) {
+    printf("Unable to map shared memory %s: %s\n", name, strerror(errno));
+    exit(1);
+  }
+  lock_pulse_storage(shm, total_size);
+
+  shm->version = PULSEIN_SHM_VERSION;
+  shm->capacity = max_pulses;
+  shm->slots = slots;
+  shm->record_size = ring_element_size();
+  shm->header_size = header_size;
+  shm->resolution_ns = nanosecond_widths ? 1 : 1000;
+  cbuf_handle_t cbuf =
+      circular_buf_init_shared((char *)shm + header_size, max_pulses,
+                               ring_element_size(), &shm->indices);
+  // readers check the magic last, once everything else is in place
+  atomic_thread_fence(memory_order_release);
+  shm->magic = PULSEIN_SHM_MAGIC;
+  return cbuf;
+}
+
+// bytes a ring buffer element takes: a 16 bit code with --compact, a
+// storage_t width or a struct pulsein_record otherwise
+size_t ring_element_size(void) {
+  return compact_widths ? sizeof(compact_code_t)
+                        : pulse_words * sizeof(storage_t);
+}
+
+// Backing for one line's ring when it isn't in shared memory. Huge pages
+// (--huge-pages) if we can get them, so that a big ring doesn't thrash the
+// TLB, normal pages otherwise.
+void *allocate_pulse_storage(size_t max_pulses) {
+  static bool warned = false;
+  size_t size = circular_buf_slots(max_pulses) * ring_element_size();
+  // populated up front, capture shouldn't be the one to fault pages in
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE;
+  void *storage = MAP_FAILED;
+
+  if (huge_pages) {
+    // the kernel rounds size up to whole huge pages
+    storage = mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB,
+                   -1, 0);
+    if ((storage == MAP_FAILED) && !warned) {
+      fprintf(stderr, "Unable to get huge pages (%s), using normal ones\n",
+              strerror(errno));
+      warned = true;
+    }
+  }
+  if (storage == MAP_FAILED) {
+    storage = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+  }
+  if (storage == MAP_FAILED) {
+    printf("Unable to allocate room for %zu pulses: %s\n", max_pulses,
+           strerror(errno));
+    exit(1);
+  }
+  lock_pulse_storage(storage, size);
+  return storage;
+}
+
+// keeps ring storage resident so capture never waits on a page fault
+void lock_pulse_storage(void *storage, size_t size) {
+  static bool warned = false;
+  if ((mlock(storage, size) != 0) && !warned) {
+    fprintf(stderr, "Unable to lock pulse storage in memory (%s), capture "
+                    "may stall on page faults\n",
+            strerror(errno));
+    warned = true;
+  }
+}
+
+// most pulses one reply can carry in the current pulse format
+size_t reply_max_pulses(bool binary) {
+  if (binary) {
+    return BINARY_MAX_WORDS / pulse_words;
+  }
+  return (VMSG_MAXSIZE - 1) /
+         (pulse_records ? RECORD_TEXT_MAX : WIDTH_TEXT_MAX);
+}
+
+// header plus little-endian records, see struct pulsein_binary_header
+void send_binary_reply(struct ipc_session *session,
+                       struct pulse_channel *channel, storage_t *pulses,
+                       size_t count) {
+  send_binary_records(session, 0, channel->ringbuffer, pulse_count(channel),
+                      pulses, count);
+}
+
+// flags on top of the ones that follow from pending and the pulse format
+void send_binary_records(struct ipc_session *session, uint32_t flags,
+                         cbuf_handle_t ringbuffer, size_t pending,
+                         storage_t *pulses, size_t count) {
+  struct pulsein_binary_header header;
+
+  header.count = htole32(count);
+  header.flags = htole32(flags | (pending ? PULSEIN_FLAG_MORE : 0) |
+                         (nanosecond_widths ? PULSEIN_FLAG_NANOSECONDS : 0) |
+                         (pulse_records ? PULSEIN_FLAG_RECORDS : 0));
+  header.overflows = htole32(circular_buf_overflows(ringbuffer));
+  header.pending = htole32(pending);
+
+  // in place, the records go out straight from the caller's array
+  if (pulse_records) {
+    for (size_t i = 0; i < count; i++) {
+      struct pulsein_record record;
+      memcpy(&record, pulses + i * pulse_words, sizeof(record));
+      record.start_ns = htole64(record.start_ns);
+      record.width = htole32(record.width);
+      record.flags = htole32(record.flags);
+      memcpy(pulses + i * pulse_words, &record, sizeof(record));
+    }
+  } else {
+    for (size_t i = 0; i < count; i++) {
+      pulses[i] = htole32(pulses[i]);
+    }
+  }
+
+  struct iovec iov[2] = {{&header, sizeof(header)},
+                         {pulses, count * pulse_words * sizeof(storage_t)}};
+  send_reply(session, iov, 2);
+}
+
+// the '^' and 'i' reply, a single pulse or -1 in ASCII if there isn't one
+void send_pulse_reply(struct ipc_session *session,
+                      struct pulse_channel *channel, storage_t *pulse,
+                      bool found) {
+  char reply[RECORD_TEXT_MAX + 1];
+  if (session->binary_replies) {
+    send_binary_reply(session, channel, pulse, found ? 1 : 0);
+    return;
+  }
+  struct circular_buf_span span = {pulse, 1, NULL, 0, 0};
+  if (found) {
+    format_pulses(reply, sizeof(reply), &span, 1, "");
+  } else {
+    strcpy(reply, "-1");
+  }
+  send_text_reply(session, reply);
+}
+
+// Pops up to requested pulses (0 or too many: as many as fit) into one 'd'
+// style reply
+void send_drain_reply(struct ipc_session *session,
+                      struct pulse_channel *channel, size_t requested) {
+  storage_t drained[BINARY_MAX_WORDS];
+  char message[VMSG_MAXSIZE];
+  size_t max_drain = reply_max_pulses(session->binary_replies);
+  if ((requested > 0) && (requested < max_drain)) {
+    max_drain = requested;
+  }
+  if (session->binary_replies) {
+    size_t count = take_pulses(channel, drained, max_drain);
+    send_binary_reply(session, channel, drained, count);
+    return;
+  }
+  // formatted straight out of the ring, and again if the pulses went
+  // elsewhere before we could take them
+  struct pulse_peek peek;
+  size_t count;
+  do {
+    count = peek_pulses(channel, &peek, drained, max_drain);
+    format_pulses(message + 1, sizeof(message) - 1, &peek.pulses, count,
+                  ",");
+  } while (consume_pulses(channel, &peek) != 0);
+  // first character tells the client whether to come back for more
+  message[0] = circular_buf_empty(channel->ringbuffer) ? '.' : '+';
+  send_text_reply(session, message);
+}
+
+// Writes count pulses from span to text between separators, returns the
+// length. Widths are plain decimals, records "<start_ns> <width> <flags>".
+// Fits if text has room for WIDTH_TEXT_MAX or RECORD_TEXT_MAX per pulse
+// (plus the length of separator beyond one).
+size_t format_pulses(char *text, size_t size,
+                     const struct circular_buf_span *span, size_t count,
+                     const char *separator) {
+  size_t len = 0;
+  text[0] = '\0';
+  for (size_t i = 0; i < count; i++) {
+    const storage_t *pulse =
+        i < span->first_len
+            ? (const storage_t *)span->first + i * pulse_words
+            : (const storage_t *)span->second +
+                  (i - span->first_len) * pulse_words;
+    const char *before = i ? separator : "";
+    if (pulse_records) {
+      struct pulsein_record record;
+      memcpy(&record, pulse, sizeof(record));
+      len += snprintf(text + len, size - len, "%s%lld %u %u", before,
+                      (long long)record.start_ns, record.width, record.flags);
+    } else {
+      len += snprintf(text + len, size - len, "%s%u", before, *pulse);
+    }
+  }
+  return len;
+}
+
+// Pushes up to a batch of the session's subscription without taking the
+// pulses out of the ring, returns how many went out
+size_t send_push_reply(struct ipc_session *session) {
+  storage_t pushed[BINARY_MAX_WORDS];
+  char message[VMSG_MAXSIZE];
+  cbuf_handle_t ringbuffer = session->sub_channel->ringbuffer;
+  size_t count = read_pulses(session->sub_channel, &session->sub_position,
+                             pushed, session->sub_batch);
+  if (count == 0) {
+    return 0;
+  }
+  uint32_t pending = circular_buf_head(ringbuffer) - session->sub_position;
+  if (session->binary_replies) {
+    send_binary_records(session, PULSEIN_FLAG_PUSH, ringbuffer, pending,
+                        pushed, count);
+    return count;
+  }
+  // '=' tells a push from a reply
+  struct circular_buf_span span = {pushed, count, NULL, 0, 0};
+  message[0] = '=';
+  format_pulses(message + 1, sizeof(message) - 1, &span, count, ",");
+  send_text_reply(session, message);
+  return count;
+}
+
+// Pulses in the channel's ring. With --compact the codes have to be
+// counted through, O(n) rather than O(1).
+size_t pulse_count(struct pulse_channel *channel) {
+  if (!compact_widths) {
+    return circular_buf_size(channel->ringbuffer);
+  }
+  // out first, whatever came out since went in before. A consumer may count
+  // out pulses the capture thread is yet to count in, for a moment.
+  uint32_t out = atomic_load_explicit(&channel->compact_out,
+                                      memory_order_acquire);
+  int32_t count = atomic_load_explicit(&channel->compact_in,
+                                       memory_order_acquire) - out;
+  return count < 0 ? 0 : count;
+}
+
+// Points peek at up to max of the oldest pulses without taking them. They
+// stay in the ring unless --compact has them decoded into buffer (room for
+// max widths), either way they only count once consume_pulses() succeeds.
+// Returns the number of pulses.
+size_t peek_pulses(struct pulse_channel *channel, struct pulse_peek *peek,
+                   storage_t *buffer, size_t max) {
+  if (!compact_widths) {
+    peek->elements = circular_buf_peek_span(channel->ringbuffer, &peek->ring,
+                                            max);
+    peek->pulses = peek->ring;
+    return peek->elements;
+  }
+  size_t count;
+  peek->elements = 0;
+  circular_buf_peek_span(channel->ringbuffer, &peek->ring,
+                         max * COMPACT_CODES_MAX);
+  count = compact_decode(&peek->ring, &peek->elements, buffer, max);
+  peek->pulses = (struct circular_buf_span){buffer, count, NULL, 0, 0};
+  return count;
+}
+
+// Takes the pulses peek_pulses() found out of the ring, returns 0 on
+// success or -1 if they were taken or overwritten in the meantime
+int consume_pulses(struct pulse_channel *channel,
+                   const struct pulse_peek *peek) {
+  if (circular_buf_consume(channel->ringbuffer, &peek->ring,
+                           peek->elements) != 0) {
+    return -1;
+  }
+  if (compact_widths) {
+    atomic_fetch_add(&channel->compact_out, peek->pulses.first_len);
+  }
+  return 0;
+}
+
+// Empties the channel's ring, the 'c' command. With --compact the pulses
+// are taken like any consumer would, so that pulse_count() keeps counting.
+void clear_pulses(struct pulse_channel *channel) {
+  if (!compact_widths) {
+    circular_buf_reset(channel->ringbuffer);
+    return;
+  }
+  struct pulse_peek peek;
+  do {
+    // there can't be more pulses than codes
+    peek_pulses(channel, &peek, NULL,
+                circular_buf_capacity(channel->ringbuffer));
+  } while (consume_pulses(channel, &peek) != 0);
+}
+
+// Copies up to max of the oldest pulses to pulses and takes them out of the
+// ring, returns how many
+size_t take_pulses(struct pulse_channel *channel, storage_t *pulses,
+                   size_t max) {
+  if (!compact_widths) {
+    return circular_buf_get_range(channel->ringbuffer, pulses, max);
+  }
+  struct pulse_peek peek;
+  size_t count;
+  do {
+    count = peek_pulses(channel, &peek, pulses, max);
+  } while (consume_pulses(channel, &peek) != 0);
+  return count;
+}
+
+// Copies the pulse index places from the oldest without taking it, returns
+// whether there is one
+bool peek_pulse(struct pulse_channel *channel, size_t index,
+                storage_t *pulse) {
+  if (!compact_widths) {
+    return circular_buf_peek(channel->ringbuffer, index, pulse) == 0;
+  }
+  struct circular_buf_span codes, check;
+  bool found;
+  do {
+    size_t offset = 0;
+    circular_buf_peek_span(channel->ringbuffer, &codes, SIZE_MAX);
+    compact_decode(&codes, &offset, NULL, index);
+    found = compact_decode(&codes, &offset, pulse, 1) == 1;
+    // if the oldest is still where it was, nothing we decoded was reused
+    circular_buf_peek_span(channel->ringbuffer, &check, 0);
+  } while (check.position != codes.position);
+  return found;
+}
+
+// circular_buf_read_at() in pulses, for subscriptions. A --compact width
+// the copy cut short is left at *position to be read whole next time.
+size_t read_pulses(struct pulse_channel *channel, uint32_t *position,
+                   storage_t *pulses, size_t max) {
+  if (!compact_widths) {
+    return circular_buf_read_at(channel->ringbuffer, position, pulses, max);
+  }
+  compact_code_t codes[BINARY_MAX_WORDS * COMPACT_CODES_MAX];
+  if (max > BINARY_MAX_WORDS) {
+    max = BINARY_MAX_WORDS;
+  }
+  size_t len = circular_buf_read_at(channel->ringbuffer, position, codes,
+                                    max * COMPACT_CODES_MAX);
+  struct circular_buf_span span = {codes, len, NULL, 0, 0};
+  size_t offset = 0;
+  size_t count = compact_decode(&span, &offset, pulses, max);
+  *position -= len - offset;
+  return count;
+}
+
+// 'name=value' pairs of the capture statistics. The longest sample period
+// starts over from here.
+void send_stats_reply(struct ipc_session *session) {
+  char reply[VMSG_MAXSIZE];
+  size_t overflows = 0;
+  for (unsigned int i = 0; i < num_channels; i++) {
+    overflows += circular_buf_overflows(channels[i].ringbuffer);
+  }
+  snprintf(reply, sizeof(reply),
+           "samples=%u edges=%u pulses=%u overflows=%zu max_period_ns=%u "
+           "avg_period_ns=%u capture_spins=%u trigger_spins=%u "
+           "missed_samples=%u idle_sleeps=%u tick_ps=%u tick_drift_ppm=%d",
+           atomic_load(&stats.samples), atomic_load(&stats.edges),
+           atomic_load(&stats.pulses), overflows,
+           atomic_exchange(&stats.max_period_ns, 0),
+           atomic_load(&stats.avg_period_ns),
+           atomic_load(&stats.capture_spins),
+           atomic_load(&stats.trigger_spins),
+           atomic_load(&stats.missed_samples),
+           atomic_load(&stats.idle_sleeps), atomic_load(&stats.tick_ps),
+           atomic_load(&stats.tick_drift_ppm));
+  send_text_reply(session, reply);
+}
+
+// Blocks until the channel holds at least count pulses, or until
+// deadline_ns (on monotonic_ns(), 0 for no deadline) has passed.
+void wait_for_pulses(struct pulse_channel *channel, size_t count,
+                     int64_t deadline_ns) {
+  struct timespec deadline = {deadline_ns / NS_PER_SECOND,
+                              deadline_ns % NS_PER_SECOND};
+  pthread_mutex_lock(&wait_mtx);
+  // armed before we look at the ring, and again after every wakeup as the
+  // capture thread disarms it when it signals
+  arm_waiter(channel, count);
+  while (pulse_count(channel) < count) {
+    int ret = deadline_ns ? pthread_cond_timedwait(&wait_cond, &wait_mtx,
+                                                   &deadline)
+                          : pthread_cond_wait(&wait_cond, &wait_mtx);
+    if (ret == ETIMEDOUT) {
+      break;
+    }
+    arm_waiter(channel, count);
+  }
+  pthread_mutex_unlock(&wait_mtx);
+}
+
+// Asks the capture thread to wake the waiters once the channel holds count
+// pulses. Several waiters share one threshold, the lowest, and whoever isn't
+// satisfied yet when woken arms again. A threshold of 0 means nobody waits,
+// so a count of 0 (satisfied already) leaves it alone.
+void arm_waiter(struct pulse_channel *channel, size_t count) {
+  if (count == 0) {
+    return;
+  }
+  unsigned int threshold = atomic_load(&channel->wait_threshold);
+  while ((threshold == 0) || (count < threshold)) {
+    if (atomic_compare_exchange_weak(&channel->wait_threshold, &threshold,
+                                     count)) {
+      break;
+    }
+  }
+}
+
+// Called by the capture threads after storing a pulse. Costs a fence and
+// two loads unless a 'w' command or a subscription is waiting, and only
+// signals when the ring reaches what they're waiting for.
+void notify_waiter(struct pulse_channel *channel) {
+  // pairs with arm_waiter() and the socket thread publishing what they wait
+  // for before reading the ring: either they see our pulse or we see them
+  atomic_thread_fence(memory_order_seq_cst);
+  unsigned int threshold =
+      atomic_load_explicit(&channel->wait_threshold, memory_order_relaxed);
+  if ((threshold != 0) &&
+      (pulse_count(channel) >= threshold) &&
+      (atomic_exchange(&channel->wait_threshold, 0) != 0)) {
+    pthread_mutex_lock(&wait_mtx);
+    pthread_cond_broadcast(&wait_cond);
+    pthread_mutex_unlock(&wait_mtx);
+    socket_server_wake();
+  }
+
+  if (atomic_load_explicit(&channel->push_armed, memory_order_relaxed) &&
+      ((int32_t)(circular_buf_head(channel->ringbuffer) -
+                 atomic_load_explicit(&channel->push_at,
+                                      memory_order_relaxed)) >= 0) &&
+      atomic_exchange(&channel->push_armed, false)) {
+    socket_server_wake();
+  }
+}
+
+// drains the ringbuffers, safe to call while the capture thread is running
+// one line per channel, prefixed with the offset when there's more than one
+void print_pulses(void) {
+  for (unsigned int c = 0; c < num_channels; c++) {
+    struct pulse_channel *channel = &channels[c];
+    if (num_channels > 1) {
+      printf("%u: ", channel->offset);
+    }
+    // what's there now, the capture may still be adding to it
+    size_t remaining = pulse_count(channel);
+    bool first = true;
+    while (remaining > 0) {
+      char text[PRINT_CHUNK_PULSES * (RECORD_TEXT_MAX + 1)];
+      storage_t decoded[PRINT_CHUNK_PULSES];
+      struct pulse_peek peek;
+      size_t count;
+      do {
+        count = peek_pulses(channel, &peek, decoded,
+                            remaining < PRINT_CHUNK_PULSES ? remaining
+                                                           : PRINT_CHUNK_PULSES);
+        format_pulses(text, sizeof(text), &peek.pulses, count, ", ");
+      } while (consume_pulses(channel, &peek) != 0);
+      if (count == 0) {
+        break;
+      }
+      printf("%s%s", first ? "" : ", ", text);
+      first = false;
+      remaining -= count;
+    }
+    printf("\n");
+  }
 }
 
 void set_max_priority(void) {
@@ -394,173 +1328,701 @@ void set_max_priority(void) {
   sched_setscheduler(0, SCHED_FIFO, &sched);
 }
 
-// not thread-safe, expects exclusive access to line
-void pulse_output(struct gpiod_line *line, bool idle_state,
-                  int trigger_len_us) {
+// Keeps everything we map from now on resident, so that no thread waits on
+// a page fault once running. Locked as pages are first touched where the
+// kernel can, or thread stacks would be locked in whole.
+void lock_all_memory(void) {
+  struct rlimit limit;
+  int flags = MCL_CURRENT | MCL_FUTURE;
+#ifdef MCL_ONFAULT
+  flags |= MCL_ONFAULT;
+#endif
+
+  // past a memlock limit every later mmap would fail, thread stacks
+  // included, so leave that to the mlock of the rings
+  if ((geteuid() != 0) && (getrlimit(RLIMIT_MEMLOCK, &limit) == 0) &&
+      (limit.rlim_cur != RLIM_INFINITY)) {
+    fprintf(stderr, "Not locking all memory under a memlock limit, "
+                    "capture may stall on page faults\n");
+    return;
+  }
+  if (mlockall(flags) != 0) {
+    fprintf(stderr, "Unable to lock memory (%s), capture may stall on page "
+                    "faults\n",
+            strerror(errno));
+  }
+}
+
+// Puts the calling thread where placement says and faults in its stack,
+// first thing in every thread we start. name is for the error message.
+void place_thread(const struct thread_placement *placement,
+                  const char *name) {
+  volatile unsigned char stack[STACK_PREFAULT_SIZE];
+  int err;
+
+  if (placement->cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(placement->cpu, &cpus);
+    err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (err != 0) {
+      printf("Unable to run the %s thread on CPU %d: %s\n", name,
+             placement->cpu, strerror(err));
+      exit(1);
+    }
+  }
+  if (placement->priority >= 0) {
+    struct sched_param sched;
+    memset(&sched, 0, sizeof(sched));
+    sched.sched_priority = placement->priority;
+    err = pthread_setschedparam(pthread_self(),
+                                placement->priority ? SCHED_FIFO : SCHED_OTHER,
+                                &sched);
+    if (err != 0) {
+      printf("Unable to set the %s thread's priority to %d: %s\n", name,
+             placement->priority, strerror(err));
+      exit(1);
+    }
+  }
+  // one write per page is enough to fault it in (and lock it)
+  for (size_t i = 0; i < sizeof(stack); i += 4096) {
+    stack[i] = 0;
+  }
+}
+
+// not thread-safe, expects exclusive access to the backend
+// returns the width of the pulse we actually drove, in nanoseconds
+int64_t pulse_output(unsigned int line, bool idle_state, int trigger_len_us) {
   // printf("Triggering output for %d microseconds\n", trigger_len_us);
-  gpiod_line_release(line);
   // set to an output
-  if (gpiod_line_request_output(line, consumername, idle_state) != 0) {
+  if (backend->set_output(line, idle_state) != 0) {
     printf("Unable to set line to output\n");
     exit(1);
   }
-  // set 'active'
-  if (gpiod_line_set_value(line, !idle_state) != 0) {
+  // set 'active', the edge happens somewhere inside the call so take the
+  // middle of it as its time
+  int64_t before_active = monotonic_ns();
+  if (backend->set_output(line, !idle_state) != 0) {
     printf("Unable to set line for trigger pulse\n");
     exit(1);
   }
-  // wait
-  busy_wait_milliseconds(trigger_len_us / 1000);
+  int64_t after_active = monotonic_ns();
+  int64_t active_edge = before_active + (after_active - before_active) / 2;
+  // wait, aiming for the next call to land its edge on time
+  delay_until(active_edge + trigger_len_us * 1000LL -
+              (after_active - before_active) / 2);
   // set back to idle
-  if (gpiod_line_set_value(line, idle_state) != 0) {
+  int64_t before_idle = monotonic_ns();
+  if (backend->set_output(line, idle_state) != 0) {
     printf("Unable to set line for trigger pulse\n");
     exit(1);
   }
-
-  // release for input usage
-  gpiod_line_release(line);
+  int64_t after_idle = monotonic_ns();
 
   // set back to an input
-  if (gpiod_line_request_input(line, consumername) != 0) {
+  if (backend->set_input(line) != 0) {
     printf("Unable to set line to input\n");
     exit(1);
   }
+  return before_idle + (after_idle - before_idle) / 2 - active_edge;
 }
 
-// not thread-safe, expects exclusive access to line
-float calculate_us_per_tick(struct gpiod_line *line) {
-  struct timeval time_event;
-  double previous_time, current_time;
-  // self calibrate best we can
-  // printf("Calculating us per tick\n");
+// for counters with a single writer, cheaper than a read-modify-write
+static inline void stat_add(_Atomic uint32_t *counter, uint32_t n) {
+  atomic_store_explicit(
+      counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+      memory_order_relaxed);
+}
 
-  if (gpiod_line_request_input(line, consumername) != 0) {
-    printf("Unable to set line to input\n");
-    exit(1);
+// stat_add() for a count that vouches for what was stored before it
+static inline void stat_publish(_Atomic uint32_t *counter, uint32_t n) {
+  atomic_store_explicit(
+      counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+      memory_order_release);
+}
+
+// Counts a line read by the polling thread, period_ns after the one before
+// (0 when not known)
+void count_sample(int64_t period_ns) {
+  stat_add(&stats.samples, 1);
+  if (period_ns <= 0) {
+    return;
+  }
+  uint32_t period = period_ns > UINT32_MAX ? UINT32_MAX : period_ns;
+  // 'S' may reset it meanwhile, we then just put back a recent period
+  if (period > atomic_load_explicit(&stats.max_period_ns,
+                                    memory_order_relaxed)) {
+    atomic_store_explicit(&stats.max_period_ns, period, memory_order_relaxed);
+  }
+  // exponential, 1/16 of the way to the new period
+  int64_t avg =
+      atomic_load_explicit(&stats.avg_period_ns, memory_order_relaxed);
+  avg += ((int64_t)period - avg) / 16;
+  atomic_store_explicit(&stats.avg_period_ns, avg, memory_order_relaxed);
+}
+
+// the length of a tick for 'S', and how far recalibration has moved it
+static void publish_tick(void) {
+  double tick_ps = ns_per_tick * 1000;
+  atomic_store_explicit(&stats.tick_ps,
+                        tick_ps > UINT32_MAX ? UINT32_MAX : tick_ps,
+                        memory_order_relaxed);
+  if (calibrated_ns_per_tick > 0) {
+    atomic_store_explicit(&stats.tick_drift_ppm,
+                          (ns_per_tick / calibrated_ns_per_tick - 1) * 1e6,
+                          memory_order_relaxed);
+  }
+}
+
+// Slow mode, a tick costs more or less as the CPU clock scales, throttles
+// or gets shared. Every RECALIBRATE_TICKS ticks this times them and moves
+// ns_per_tick 1/16 of the way to what they really took, which keeps widths
+// true over hours for one clock read in that many samples. *mark_tick and
+// *mark_ns are the tick timed last, *epoch_ns moves so that current_tick
+// stays where the clock says it is. When the ticks since the mark include a
+// stall that wasn't the tick's doing (waiting on a trigger pulse for the
+// line) they're not measured, only the mark moves on.
+void recalibrate_ticks(long int current_tick, bool stalled,
+                       long int *mark_tick, int64_t *mark_ns,
+                       int64_t *epoch_ns) {
+  int64_t now = backend->timestamp();
+  if (!stalled && (current_tick > *mark_tick)) {
+    double measured = (double)(now - *mark_ns) / (current_tick - *mark_tick);
+    ns_per_tick += (measured - ns_per_tick) / 16;
+  }
+  *epoch_ns = now - current_tick * ns_per_tick;
+  *mark_tick = current_tick;
+  *mark_ns = now;
+  publish_tick();
+}
+
+// Sleeps until the --sample-period sample due at *next_ns and moves that on
+// to the next one. Should we wake too late for some, they're skipped and
+// counted as missed, so that the tick count still tells the time. Returns
+// the periods since the sample before.
+long int await_sample(int64_t *next_ns, int64_t *last_ns) {
+  struct timespec due = {*next_ns / NS_PER_SECOND, *next_ns % NS_PER_SECOND};
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) ==
+         EINTR)
+    ;
+  int64_t now = monotonic_ns();
+  long int periods = 1 + (now - *next_ns) / sample_period_ns;
+  if (periods > 1) {
+    stat_add(&stats.missed_samples, periods - 1);
+  }
+  count_sample(now - *last_ns);
+  *last_ns = now;
+  *next_ns += periods * sample_period_ns;
+  return periods;
+}
+
+// Throws away the edges the kernel has queued up so far
+void flush_edges(void) {
+  struct pulsein_edge edges[EVENT_BATCH_SIZE];
+  pthread_mutex_lock(&line_mtx);
+  while (backend->read_events(edges, EVENT_BATCH_SIZE, 0) > 0)
+    ;
+  pthread_mutex_unlock(&line_mtx);
+}
+
+// --idle-sleep: sleeps in the kernel until an edge on any line, or
+// EVENT_WAIT_TIMEOUT_NS at most so that pausing, triggering and the timeout
+// still get a look in. The edges that woke us, and any right behind them,
+// become pulses with the kernel's timestamps, so the first pulses of a
+// burst are as exact as the ones polling times. Returns the number of
+// edges, *last_change_ns moves on to the latest.
+int sleep_until_edge(int64_t *last_change_ns) {
+  struct pulsein_edge edges[EVENT_BATCH_SIZE];
+  storage_t pulse[PULSEIN_RECORD_WORDS];
+  int64_t timeout = EVENT_WAIT_TIMEOUT_NS;
+  int total = 0;
+
+  while (atomic_load_explicit(&line_waiters, memory_order_relaxed)) {
+    sched_yield();
+  }
+  for (;;) {
+    pthread_mutex_lock(&line_mtx);
+    int num_events = backend->read_events(edges, EVENT_BATCH_SIZE, timeout);
+    pthread_mutex_unlock(&line_mtx);
+    if ((num_events < 0) && (errno != EINTR)) {
+      printf("Unable to read line events\n");
+      exit(1);
+    }
+    if (num_events <= 0) {
+      // SIGINT is looked at by the caller
+      return total;
+    }
+
+    // the kernel stamps events on CLOCK_MONOTONIC, polling uses the
+    // backend's clock
+    int64_t now = backend->timestamp();
+    int64_t offset = now - monotonic_ns();
+    for (int i = 0; i < num_events; i++) {
+      struct pulse_channel *channel = &channels[edges[i].line];
+      struct pulsein_edge edge = edges[i];
+      edge.timestamp_ns += offset;
+      if (edge.timestamp_ns > now) {
+        // v1 on kernels before 5.7 stamps CLOCK_REALTIME, the best we can
+        // do then is when we woke up
+        edge.timestamp_ns = now;
+      }
+      if ((edge.value == channel->previous_value) &&
+          (edge.timestamp_ns <= channel->previous_time)) {
+        // came in after the flush, but polling has seen it already
+        continue;
+      }
+      stat_add(&stats.edges, 1);
+      size_t words = record_edge(channel, &edge, pulse);
+      if (words > 0) {
+        store_pulses(channel, pulse, words / pulse_words);
+      }
+      if (edge.timestamp_ns > *last_change_ns) {
+        *last_change_ns = edge.timestamp_ns;
+      }
+    }
+    total += num_events;
+    // take whatever else is queued, but don't wait for more
+    timeout = 0;
   }
+}
 
-  gettimeofday(&time_event, NULL);
-  previous_time = time_event.tv_sec;
-  previous_time *= 1000000;
-  previous_time += time_event.tv_usec;
+// forget the current level, the next change away from idle starts a pulse
+void reset_channel(struct pulse_channel *channel, int64_t now) {
+  channel->previous_value = idle_state;
+  channel->waiting_for_first_change = true;
+  channel->previous_time = now;
+  channel->previous_tick = 0;
+  channel->uncertain = false;
+}
 
+// not thread-safe, expects exclusive access to the backend
+double calculate_ns_per_tick(void) {
+  int64_t previous_time, current_time;
+  int values[MAX_LINES];
+  // self calibrate best we can
+  // printf("Calculating ns per tick\n");
+
+  previous_time = backend->timestamp();
   for (int i = 0; i < 100; i++) {
-    int ret = gpiod_line_get_value(line);
+    int ret = backend->read_values(values);
     if (ret == -1) {
-      printf("Unable to read line during calibration\n");
+      printf("Unable to read lines during calibration\n");
       exit(1);
     }
   }
-  gettimeofday(&time_event, NULL);
-  current_time = time_event.tv_sec;
-  current_time *= 1000000;
-  current_time += time_event.tv_usec;
-  float us_per_tick = (current_time - previous_time) / 100;
-  // printf("us_per_tick: %f\n", us_per_tick);
-  // Be kind, rewind!
-  gpiod_line_release(line);
-  return us_per_tick;
+  current_time = backend->timestamp();
+  double ns_per_tick = (current_time - previous_time) / 100.0;
+  // printf("ns_per_tick: %f\n", ns_per_tick);
+  return ns_per_tick;
 }
 
 void *polling_thread_runner(void *args) {
-  int value, previous_value;
-  struct timeval time_event;
-  double previous_time = 0, current_time;
-  long int previous_tick, current_tick;
-  bool waiting_for_first_change = true;
+  int values[MAX_LINES];
+  int64_t current_time = 0, last_change_time;
+  long int current_tick = 0, last_change_tick = 0, timeout_ticks = 0;
+  // slow mode: when tick 0 was, records start at a multiple of ns_per_tick
+  // from here, and the tick recalibrate_ticks() timed last
+  int64_t tick_epoch_ns = 0, calibration_ns = 0;
+  long int calibration_tick = 0;
+  // --sample-period: when the next sample is due and when the last one was
+  // taken, on monotonic_ns()
+  int64_t next_sample_ns = 0, last_sample_ns = 0;
+  // --idle-sleep: edges queued while polling are gone and the lines were
+  // read once more since, then whether we're asleep on edge events
+  bool idle_flushed = false, sleeping = false;
+
+  place_thread(&capture_placement, "capture");
+  accept_interrupts();
 
   if (fast_linux) {
-    gettimeofday(&time_event, NULL);
-    previous_time = time_event.tv_sec;
-    previous_time *= 1000000;
-    previous_time += time_event.tv_usec;
+    current_time = backend->timestamp();
   } else {
-    previous_tick = current_tick = 0;
+    // compare ticks, not times, so there's no float math per sample
+    timeout_ticks = timeout_ns / ns_per_tick;
+    tick_epoch_ns = calibration_ns = backend->timestamp();
+    next_sample_ns = last_sample_ns = monotonic_ns() + sample_period_ns;
+    publish_tick();
+  }
+  if (sample_period_ns) {
+    // SCHED_FIFO threads get no timer slack, the others 50us by default,
+    // which is more than a short --sample-period
+    prctl(PR_SET_TIMERSLACK, 1UL);
   }
+  last_change_time = current_time;
 
   // We record the first change from the idle_state
-  previous_value = idle_state;
+  for (unsigned int i = 0; i < num_channels; i++) {
+    reset_channel(&channels[i], current_time);
+  }
 
   for (;;) {
     // block as long as we are paused, keeping the CPU idle
-    pthread_mutex_lock(&barrier);
+    pthread_mutex_lock(&pause_mtx);
+    wait_while_paused();
 
     if (was_paused) {
       // reset the timestamp when unpaused
       if (fast_linux) {
-        gettimeofday(&time_event, NULL);
-        previous_time = time_event.tv_sec;
-        previous_time *= 1000000;
-        previous_time += time_event.tv_usec;
+        current_time = backend->timestamp();
       } else {
-        previous_tick = current_tick = 0;
+        current_tick = calibration_tick = 0;
+        tick_epoch_ns = calibration_ns = backend->timestamp();
+        next_sample_ns = last_sample_ns = monotonic_ns() + sample_period_ns;
+      }
+      for (unsigned int i = 0; i < num_channels; i++) {
+        reset_channel(&channels[i], current_time);
       }
-      previous_value = idle_state;
-      waiting_for_first_change = true;
+      last_change_time = current_time;
+      last_change_tick = current_tick;
+      idle_flushed = sleeping = false;
       was_paused = false;
     }
 
-    pthread_mutex_unlock(&barrier);
+    pthread_mutex_unlock(&pause_mtx);
+
+    if (sleeping) {
+      if (sleep_until_edge(&last_change_time) > 0) {
+        // spin again for the rest of the burst
+        idle_flushed = sleeping = false;
+        current_time = backend->timestamp();
+      } else if (exit_on_timeout &&
+                 (backend->timestamp() - last_change_time) >= timeout_ns) {
+        print_pulses();
+        exit(EXIT_SUCCESS);
+      }
+      continue;
+    }
+
+    // ticks this sample is after the one before, more than one when
+    // --sample-period samples had to be skipped
+    long int ticks = 1;
+    if (sample_period_ns) {
+      ticks = await_sample(&next_sample_ns, &last_sample_ns);
+    }
 
     // spin lock in order to keep the CPU awake and clocked high
-    while (pthread_mutex_trylock(&line_mtx) != 0)
-      ;
-    value = gpiod_line_get_value(line);
+    unsigned int spins = 0;
+    while (atomic_load_explicit(&line_waiters, memory_order_relaxed) ||
+           pthread_mutex_trylock(&line_mtx) != 0)
+      spins++;
+    int ret = backend->read_values(values);
     pthread_mutex_unlock(&line_mtx);
-    if (value < 0) {
-      printf("Unable to read line %d\n", offset);
+    if (ret < 0) {
+      printf("Unable to read lines\n");
       exit(1);
     }
 
-    if (!fast_linux) {
-      current_tick++;
+    if (spins > 0) {
+      stat_add(&stats.capture_spins, spins);
     }
 
-    double delta = 0;
+    bool timed_out;
     if (fast_linux) {
-      // Get current time
-      gettimeofday(&time_event, NULL);
-      current_time = time_event.tv_sec;
-      current_time *= 1000000;
-      current_time += time_event.tv_usec;
-      delta = current_time - previous_time;
+      int64_t previous_sample = current_time;
+      current_time = backend->timestamp();
+      count_sample(current_time - previous_sample);
+      timed_out = (current_time - last_change_time) >= timeout_ns;
     } else {
-      delta = (current_tick - previous_tick) * us_per_tick;
-    }
-
-    // check for timeout:
-    if (exit_on_timeout) {
-      if (delta >= timeout_microseconds) {
-        pthread_mutex_lock(&ringbuffer_mtx);
-        print_pulses();
-        pthread_mutex_unlock(&ringbuffer_mtx);
-        exit(EXIT_SUCCESS);
+      // no clock here, that's the point of slow mode (await_sample() has
+      // counted fixed rate samples already)
+      if (!sample_period_ns) {
+        count_sample(0);
+      }
+      current_tick += ticks;
+      // --sample-period ticks are exact, and a wait for the line says
+      // nothing about what a tick costs
+      if (!sample_period_ns &&
+          ((spins > 0) ||
+           ((current_tick - calibration_tick) >= RECALIBRATE_TICKS))) {
+        recalibrate_ticks(current_tick, spins > 0, &calibration_tick,
+                          &calibration_ns, &tick_epoch_ns);
+        timeout_ticks = timeout_ns / ns_per_tick;
       }
+      timed_out = (current_tick - last_change_tick) >= timeout_ticks;
     }
 
-#if defined(FOLLOW_PULSE)
-    if (gpiod_line_set_value(line2, value) != 0) {
-      printf("Unable to set line %d to active level\n", FOLLOW_PULSE);
-      exit(1);
+    // check for timeout, i.e. every line has been quiet that long:
+    if (exit_on_timeout && timed_out) {
+      print_pulses();
+      exit(EXIT_SUCCESS);
     }
-#endif
-    if (value != previous_value) {
-      if (waiting_for_first_change && (value != idle_state)) {
+
+    for (unsigned int i = 0; i < num_channels; i++) {
+      struct pulse_channel *channel = &channels[i];
+      if (values[i] == channel->previous_value) {
+        continue;
+      }
+      stat_add(&stats.edges, 1);
+
+      if (channel->waiting_for_first_change && (values[i] != idle_state)) {
         // we *dont* save the first transition from idle value
-        waiting_for_first_change = false;
+        channel->waiting_for_first_change = false;
       } else {
-        // spin lock in order to keep the CPU awake and clocked high
-        while (pthread_mutex_trylock(&ringbuffer_mtx) != 0)
-          ;
-        circular_buf_put(ringbuffer, delta);
-        pthread_mutex_unlock(&ringbuffer_mtx);
+        storage_t pulse[PULSEIN_RECORD_WORDS];
+        size_t words;
+        if (fast_linux) {
+          words = encode_pulse(pulse, channel, channel->previous_time,
+                               current_time - channel->previous_time);
+        } else {
+          words = encode_pulse(
+              pulse, channel,
+              tick_epoch_ns + channel->previous_tick * ns_per_tick,
+              (current_tick - channel->previous_tick) * ns_per_tick);
+        }
+        store_pulses(channel, pulse, words / pulse_words);
       }
 
-      previous_value = value;
-      if (fast_linux) {
-        previous_time = current_time;
+      channel->previous_value = values[i];
+      channel->previous_time = last_change_time = current_time;
+      channel->previous_tick = last_change_tick = current_tick;
+    }
+
+    if (idle_sleep_ns) {
+      if ((current_time - last_change_time) < idle_sleep_ns) {
+        idle_flushed = false;
+      } else if (!idle_flushed) {
+        // any edge from here on is queued, so one more read catches the
+        // ones that came before
+        flush_edges();
+        idle_flushed = true;
+        // keep the flush out of the sample period statistics
+        current_time = backend->timestamp();
       } else {
-        previous_tick = current_tick;
+        sleeping = true;
+        stat_add(&stats.idle_sleeps, 1);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+// store_pulses() for --compact rings. A width's codes always go in and out
+// of the ring together, so rather than letting the ring drop the oldest
+// codes this drops the oldest whole widths to make room, and the overflow
+// count stays in pulses.
+static void store_compact(struct pulse_channel *channel,
+                          const storage_t *widths, size_t count) {
+  cbuf_handle_t ringbuffer = channel->ringbuffer;
+  size_t capacity = circular_buf_capacity(ringbuffer);
+  // the capture threads store EVENT_BATCH_SIZE at most
+  compact_code_t codes[EVENT_BATCH_SIZE * COMPACT_CODES_MAX];
+  size_t len = 0, first = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    len += compact_encode(codes + len, widths[i]);
+  }
+
+  if (overflow_policy == OVERFLOW_OVERWRITE) {
+    // only the newest widths that fit the ring at all can stay
+    size_t skipped = 0;
+    while (len - skipped > capacity) {
+      skipped += compact_length(widths[first++]);
+    }
+    if (first > 0) {
+      circular_buf_add_overflows(ringbuffer, first);
+    }
+    // consumers only ever make more room, so once there is enough it stays
+    for (;;) {
+      size_t used = circular_buf_size(ringbuffer);
+      if (capacity - used >= len - skipped) {
+        break;
+      }
+      struct circular_buf_span oldest;
+      size_t needed = len - skipped - (capacity - used), offset = 0;
+      size_t dropped = 0;
+      circular_buf_peek_span(ringbuffer, &oldest,
+                             needed + COMPACT_CODES_MAX - 1);
+      while (offset < needed) {
+        size_t n = compact_decode(&oldest, &offset, NULL, 1);
+        if (n == 0) {
+          break; // a consumer got there first
+        }
+        dropped += n;
+      }
+      if (circular_buf_consume(ringbuffer, &oldest, offset) == 0) {
+        circular_buf_add_overflows(ringbuffer, dropped);
+        atomic_fetch_add(&channel->compact_out, dropped);
+      }
+    }
+    circular_buf_put_range2(ringbuffer, codes + skipped, len - skipped);
+    stat_publish(&channel->compact_in, count - first);
+  } else {
+    // as many whole widths from the front as there is room for
+    size_t room = capacity - circular_buf_size(ringbuffer), fit = 0;
+    size_t stored = 0, rejected;
+    while ((stored < count) &&
+           (fit + compact_length(widths[stored]) <= room)) {
+      fit += compact_length(widths[stored++]);
+    }
+    rejected = count - stored;
+    if (fit > 0) {
+      circular_buf_put_range2(ringbuffer, codes, fit);
+      stat_publish(&channel->compact_in, stored);
+    }
+    if (rejected > 0) {
+      circular_buf_add_overflows(ringbuffer, rejected);
+      if (overflow_policy == OVERFLOW_PAUSE) {
+        pause_capture();
+      }
+    }
+  }
+}
+
+// Puts pulses in the channel's ring as --overflow says, and wakes whoever
+// waits for them. Capture threads only.
+void store_pulses(struct pulse_channel *channel, const storage_t *pulses,
+                  size_t count) {
+  stat_add(&stats.pulses, count);
+  if (compact_widths) {
+    store_compact(channel, pulses, count);
+  } else if (overflow_policy == OVERFLOW_OVERWRITE) {
+    if ((count == 1) && (pulse_words == 1)) {
+      circular_buf_put(channel->ringbuffer, pulses[0]);
+    } else {
+      circular_buf_put_range(channel->ringbuffer, pulses, count);
+    }
+  } else if ((circular_buf_put_range2(channel->ringbuffer, pulses, count) <
+              count) &&
+             (overflow_policy == OVERFLOW_PAUSE)) {
+    // we stop at the top of the loop, until a client has made room and
+    // resumes us
+    pause_capture();
+  }
+  notify_waiter(channel);
+}
+
+// Writes the pulse that started at start_ns and lasted width_ns to out in
+// the storage format, a bare width or a struct pulsein_record with
+// --records. Takes the level from channel->previous_value, so call it
+// before that moves on. Returns the storage_t written.
+size_t encode_pulse(storage_t *out, struct pulse_channel *channel,
+                    int64_t start_ns, int64_t width_ns) {
+  storage_t width = pulse_width(width_ns);
+  if (!pulse_records) {
+    *out = width;
+    return 1;
+  }
+
+  struct pulsein_record record;
+  record.start_ns = start_ns;
+  record.width = width;
+  record.flags = (channel->previous_value ? PULSEIN_RECORD_HIGH : 0) |
+                 (channel->uncertain ? PULSEIN_RECORD_UNCERTAIN : 0) |
+                 (width == UINT_MAX ? PULSEIN_RECORD_SATURATED : 0);
+  channel->uncertain = false;
+  memcpy(out, &record, sizeof(record));
+  return PULSEIN_RECORD_WORDS;
+}
+
+// Works out the pulse a kernel reported edge ends, if any, and encodes it
+// to out. Returns the storage_t written, 0 if no pulse ended.
+size_t record_edge(struct pulse_channel *channel,
+                   const struct pulsein_edge *edge, storage_t *out) {
+  size_t words = 0;
+
+  // if the kernel fifo overflowed we can see the same edge twice in a
+  // row, there is no pulse to record in that case, but the next one
+  // may hide edges we never saw
+  if (edge->value == channel->previous_value) {
+    channel->uncertain = true;
+    return 0;
+  }
+
+  if (channel->waiting_for_first_change && (edge->value != idle_state)) {
+    // we *dont* save the first transition from idle value
+    channel->waiting_for_first_change = false;
+  } else {
+    words = encode_pulse(out, channel, channel->previous_time,
+                         edge->timestamp_ns - channel->previous_time);
+  }
+
+  channel->previous_value = edge->value;
+  channel->previous_time = edge->timestamp_ns;
+  return words;
+}
+
+void *event_thread_runner(void *args) {
+  struct pulsein_edge edges[EVENT_BATCH_SIZE];
+  storage_t batch[MAX_LINES][EVENT_BATCH_SIZE * PULSEIN_RECORD_WORDS];
+  int64_t last_activity;
+
+  place_thread(&capture_placement, "capture");
+  accept_interrupts();
+
+  last_activity = backend->timestamp();
+
+  // We record the first change from the idle_state
+  for (unsigned int i = 0; i < num_channels; i++) {
+    reset_channel(&channels[i], 0);
+  }
+
+  for (;;) {
+    // block as long as we are paused, keeping the CPU idle
+    pthread_mutex_lock(&pause_mtx);
+    wait_while_paused();
+
+    if (was_paused) {
+      // throw away whatever the kernel queued up while we were paused
+      flush_edges();
+
+      for (unsigned int i = 0; i < num_channels; i++) {
+        reset_channel(&channels[i], 0);
+      }
+      last_activity = backend->timestamp();
+      was_paused = false;
+    }
+
+    pthread_mutex_unlock(&pause_mtx);
+
+    // sleep in the kernel until an edge arrives, but wake up now and then so
+    // that pausing, triggering and the timeout still get a look in
+    while (atomic_load_explicit(&line_waiters, memory_order_relaxed)) {
+      sched_yield();
+    }
+    pthread_mutex_lock(&line_mtx);
+    int num_events =
+        backend->read_events(edges, EVENT_BATCH_SIZE, EVENT_WAIT_TIMEOUT_NS);
+    pthread_mutex_unlock(&line_mtx);
+    if (num_events < 0) {
+      if (errno == EINTR) {
+        // SIGINT, looked at on the next pass
+        continue;
+      }
+      printf("Unable to read line events\n");
+      exit(1);
+    }
+    stat_add(&stats.samples, 1);
+    stat_add(&stats.edges, num_events);
+
+    // the kernel stamps events with its own clock, this one is only used for
+    // the timeout
+    int64_t current_time = backend->timestamp();
+
+    if (num_events == 0) {
+      // check for timeout:
+      if (exit_on_timeout && (current_time - last_activity) >= timeout_ns) {
+        print_pulses();
+        exit(EXIT_SUCCESS);
+      }
+      continue;
+    }
+    last_activity = current_time;
+
+    // each line's pulses from this batch go into its ring in one go,
+    // batch_len counts storage_t
+    unsigned int batch_len[MAX_LINES] = {0};
+    for (int i = 0; i < num_events; i++) {
+      unsigned int line = edges[i].line;
+      batch_len[line] += record_edge(&channels[line], &edges[i],
+                                     &batch[line][batch_len[line]]);
+    }
+    for (int i = 0; i < num_events; i++) {
+      unsigned int line = edges[i].line;
+      if (batch_len[line] > 0) {
+        store_pulses(&channels[line], batch[line],
+                     batch_len[line] / pulse_words);
+        batch_len[line] = 0;
       }
     }
   }
@@ -568,18 +2030,69 @@ void *polling_thread_runner(void *args) {
   return NULL;
 }
 
-void busy_wait_milliseconds(int millis) {
-  // Set delay time period.
-  struct timeval deltatime;
-  deltatime.tv_sec = millis / 1000;
-  deltatime.tv_usec = (millis % 1000) * 1000;
-  struct timeval walltime;
-  // Get current time and add delay to find end time.
-  gettimeofday(&walltime, NULL);
-  struct timeval endtime;
-  timeradd(&walltime, &deltatime, &endtime);
-  // Tight loop to waste time (and CPU) until enough time as elapsed.
-  while (timercmp(&walltime, &endtime, <)) {
-    gettimeofday(&walltime, NULL);
+// converts to the storage resolution, saturating rather than wrapping
+storage_t pulse_width(int64_t delta_ns) {
+  int64_t width = nanosecond_widths ? delta_ns : delta_ns / 1000;
+  if (width > UINT_MAX) {
+    return UINT_MAX;
+  }
+  return width < 0 ? 0 : width;
+}
+
+// While the PM QoS file stays open with a 0 written to it the kernel keeps
+// every CPU out of idle states with a non-zero exit latency, so neither the
+// capture thread nor a trigger pulse waits for a core to wake up.
+void latency_qos_hold(void) {
+  static bool warned = false;
+  if (latency_qos_fd >= 0) {
+    return;
+  }
+  latency_qos_fd = open("/dev/cpu_dma_latency", O_WRONLY | O_CLOEXEC);
+  if (latency_qos_fd < 0) {
+    if (!warned) {
+      fprintf(stderr, "Unable to open /dev/cpu_dma_latency (%s), CPU idle "
+                      "states stay enabled\n",
+              strerror(errno));
+      warned = true;
+    }
+    return;
+  }
+  int32_t max_latency_us = 0;
+  if (write(latency_qos_fd, &max_latency_us, sizeof(max_latency_us)) !=
+      sizeof(max_latency_us)) {
+    close(latency_qos_fd);
+    latency_qos_fd = -1;
+  }
+}
+
+// lets the CPUs idle again, nothing needs low latency while we're paused
+void latency_qos_release(void) {
+  if (latency_qos_fd >= 0) {
+    close(latency_qos_fd);
+    latency_qos_fd = -1;
+  }
+}
+
+// the clock delay_until sleeps on, clock_nanosleep can't do
+// CLOCK_MONOTONIC_RAW
+int64_t monotonic_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * NS_PER_SECOND + now.tv_nsec;
+}
+
+// Returns as close after deadline_ns (on monotonic_ns()) as we can manage:
+// sleep through most of the wait and spin for the last TRIGGER_SPIN_NS, which
+// covers the scheduler's wakeup latency.
+void delay_until(int64_t deadline_ns) {
+  int64_t sleep_until = deadline_ns - TRIGGER_SPIN_NS;
+  if (sleep_until > monotonic_ns()) {
+    struct timespec wake = {sleep_until / NS_PER_SECOND,
+                            sleep_until % NS_PER_SECOND};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) ==
+           EINTR)
+      ;
   }
+  while (monotonic_ns() < deadline_ns)
+    ;
 }
@@ -1,13 +1,192 @@
-#include <gpiod.h>
+#include "circular_buffer.h"
+#include "pulsein_backend.h"
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 
-//#define FOLLOW_PULSE  19
-#define MAX_PULSE_BUFFER 1000
+// ring capacity per line unless -p says otherwise
+#define DEFAULT_PULSE_BUFFER 1000
+// the rings index with free running 32 bit counters and round their
+// storage up to a power of two, this keeps that well clear of overflowing
+#define MAX_PULSE_BUFFER (1UL << 30)
+// lines captured at once, the kernel won't request more in one go
+#define MAX_LINES 64
+
+#define NS_PER_SECOND 1000000000LL
+
+// Binary IPC replies (after a 'b1' command) start with this header, all
+// fields little-endian, followed by count 32 bit little-endian pulse widths
+// (or count struct pulsein_record with PULSEIN_FLAG_RECORDS)
+struct pulsein_binary_header {
+  uint32_t count;     // number of pulse records following the header
+  uint32_t flags;     // PULSEIN_FLAG_*
+  uint32_t overflows; // pulses lost to a full ring buffer since startup
+  uint32_t pending;   // pulses left in the ring buffer after this reply
+                      // (16 bit codes with --compact, see pulsein_compact.h)
+};
+
+// more pulses are waiting in the ring buffer
+#define PULSEIN_FLAG_MORE 0x1
+// widths are in nanoseconds (--nanoseconds) instead of microseconds
+#define PULSEIN_FLAG_NANOSECONDS 0x2
+// pushed to a subscriber rather than a reply, pending counts what's left
+// to push
+#define PULSEIN_FLAG_PUSH 0x4
+// the records are struct pulsein_record (--records) rather than bare widths
+#define PULSEIN_FLAG_RECORDS 0x8
+
+// With --records every pulse is stored, replied and published in shared
+// memory as one of these instead of a bare width. Little-endian in binary
+// replies, native byte order in the ring and in shared memory.
+struct pulsein_record {
+  int64_t start_ns; // when the pulse began, on the capture clock
+  uint32_t width;   // same unit as the bare widths, see --nanoseconds
+  uint32_t flags;   // PULSEIN_RECORD_*
+};
+
+// storage_t a record takes in the ring
+#define PULSEIN_RECORD_WORDS (sizeof(struct pulsein_record) / sizeof(storage_t))
+
+// the line was high during the pulse, low otherwise
+#define PULSEIN_RECORD_HIGH 0x1
+// edges went missing right before the pulse (the kernel event queue
+// overflowed), so it may really be several pulses run together
+#define PULSEIN_RECORD_UNCERTAIN 0x2
+// too long for the width field, the width is clipped
+#define PULSEIN_RECORD_SATURATED 0x4
+
+// What capture does with a pulse its ring buffer has no room for, either
+// way it counts as an overflow (--overflow)
+enum overflow_policy {
+  OVERFLOW_OVERWRITE, // drop the oldest pulse to make room
+  OVERFLOW_DROP,      // drop the new pulse
+  OVERFLOW_PAUSE,     // drop the new pulse and pause until resumed
+};
+
+// Where one of our threads runs (--capture-cpu and friends), -1 leaves
+// it as set_max_priority() made the whole process
+struct thread_placement {
+  int cpu;
+  int priority; // SCHED_FIFO, 0 for normal scheduling
+};
+
+// Capture state of one line
+struct pulse_channel {
+  unsigned int offset;
+  // lock-free, the capture thread is the only producer
+  cbuf_handle_t ringbuffer;
+  int previous_value;
+  bool waiting_for_first_change;
+  int64_t previous_time;  // ns, when the current level started
+  long int previous_tick; // the same in ticks for slow mode
+  bool uncertain;         // edges were lost since the previous pulse
+  // pulse count a 'w' command is waiting for, 0 if none
+  atomic_uint wait_threshold;
+  // while push_armed, wake the socket thread once the ring head reaches
+  // push_at, for subscriptions
+  _Atomic uint32_t push_at;
+  atomic_bool push_armed;
+  // --compact rings hold codes, a width takes one to three, so these count
+  // the pulses that went in (the capture thread) and came out (consumers,
+  // and the capture thread dropping the oldest), see pulse_count()
+  _Atomic uint32_t compact_in;
+  _Atomic uint32_t compact_out;
+};
+
+// Where peek_pulses() found a channel's oldest pulses
+struct pulse_peek {
+  struct circular_buf_span ring;   // as the ring has them
+  size_t elements;                 // of the ring the pulses take up
+  struct circular_buf_span pulses; // as storage_t pulses
+};
+
+// Counters the capture thread keeps as it goes, for the 'S' command. Each
+// has a single writer and no lock, 32 bit so that they stay lock-free on 32
+// bit boards. The counts are free running, clients take differences.
+struct capture_stats {
+  // line reads when polling, event reads with --edge-events
+  _Alignas(64) _Atomic uint32_t samples;
+  _Atomic uint32_t edges;  // level changes, all lines
+  _Atomic uint32_t pulses; // pulses captured, whether there was room or not
+  // ns between consecutive line reads when polling in fast mode or at a
+  // fixed rate, the longest since the last 'S' and a moving average
+  _Atomic uint32_t max_period_ns;
+  _Atomic uint32_t avg_period_ns;
+  // turns spent waiting for line_mtx, by the polling thread and by
+  // trigger pulses (the only counter with several writers)
+  _Atomic uint32_t capture_spins;
+  _Atomic uint32_t trigger_spins;
+  // --sample-period samples skipped because we woke up too late
+  _Atomic uint32_t missed_samples;
+  // times the polling thread went to sleep on edge events (--idle-sleep)
+  _Atomic uint32_t idle_sleeps;
+  // slow mode and --sample-period, the picoseconds a tick currently counts
+  // for, and in slow mode how far (in ppm) recalibration has taken that
+  // from the startup calibration
+  _Atomic uint32_t tick_ps;
+  _Atomic int32_t tick_drift_ppm;
+};
+
+extern struct pulse_channel channels[MAX_LINES];
+extern unsigned int num_channels;
+extern struct capture_stats stats;
+extern struct thread_placement capture_placement, ipc_placement;
 
-void set_max_priority(void);
 void sig_handler(int signo);
+void accept_interrupts(void);
+void stop_if_interrupted(void);
+void wait_while_paused(void);
+void set_max_priority(void);
+void lock_all_memory(void);
+void place_thread(const struct thread_placement *placement, const char *name);
 void print_pulses(void);
-float calculate_us_per_tick(struct gpiod_line *line);
-void pulse_output(struct gpiod_line *line, bool idle_state, int trigger_len_us);
+void count_sample(int64_t period_ns);
+void recalibrate_ticks(long int current_tick, bool stalled,
+                       long int *mark_tick, int64_t *mark_ns,
+                       int64_t *epoch_ns);
+long int await_sample(int64_t *next_ns, int64_t *last_ns);
+void flush_edges(void);
+int sleep_until_edge(int64_t *last_change_ns);
+size_t reply_max_pulses(bool binary);
+size_t format_pulses(char *text, size_t size,
+                     const struct circular_buf_span *span, size_t count,
+                     const char *separator);
+cbuf_handle_t create_shared_ringbuffer(const char *name, size_t max_pulses);
+size_t ring_element_size(void);
+void *allocate_pulse_storage(size_t max_pulses);
+void lock_pulse_storage(void *storage, size_t size);
+size_t pulse_count(struct pulse_channel *channel);
+size_t peek_pulses(struct pulse_channel *channel, struct pulse_peek *peek,
+                   storage_t *buffer, size_t max);
+int consume_pulses(struct pulse_channel *channel,
+                   const struct pulse_peek *peek);
+void clear_pulses(struct pulse_channel *channel);
+size_t take_pulses(struct pulse_channel *channel, storage_t *pulses,
+                   size_t max);
+bool peek_pulse(struct pulse_channel *channel, size_t index,
+                storage_t *pulse);
+size_t read_pulses(struct pulse_channel *channel, uint32_t *position,
+                   storage_t *pulses, size_t max);
+void wait_for_pulses(struct pulse_channel *channel, size_t count,
+                     int64_t deadline_ns);
+void arm_waiter(struct pulse_channel *channel, size_t count);
+void notify_waiter(struct pulse_channel *channel);
+void pause_capture(void);
+bool resume_capture(void);
+void store_pulses(struct pulse_channel *channel, const storage_t *pulses,
+                  size_t count);
+void reset_channel(struct pulse_channel *channel, int64_t now);
+double calculate_ns_per_tick(void);
+size_t encode_pulse(storage_t *out, struct pulse_channel *channel,
+                    int64_t start_ns, int64_t width_ns);
+size_t record_edge(struct pulse_channel *channel,
+                   const struct pulsein_edge *edge, storage_t *out);
+int64_t pulse_output(unsigned int line, bool idle_state, int trigger_len_us);
+void *queue_thread_runner(void *args);
 void *polling_thread_runner(void *argsin);
-void busy_wait_milliseconds(int millis);
+void *event_thread_runner(void *argsin);
+void latency_qos_hold(void);
+void latency_qos_release(void);
+int64_t monotonic_ns(void);
+void delay_until(int64_t deadline_ns);
+storage_t pulse_width(int64_t delta_ns);
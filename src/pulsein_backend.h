@@ -0,0 +1,76 @@
+// MIT License
+//
+// Copyright (c) 2018 adafruit industries
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Everything that touches GPIO hardware goes through one of these. The
+// capture and IPC code only ever sees line indices (the position of the
+// offset on the command line) and nanosecond timestamps.
+
+#ifndef PULSEIN_BACKEND_H_
+#define PULSEIN_BACKEND_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// An edge seen by read_events
+struct pulsein_edge {
+  int64_t timestamp_ns; // when it happened, on the backend's event clock
+  unsigned int line;    // index of the line it happened on
+  int value;            // level of the line after the edge
+};
+
+struct pulsein_backend {
+  const char *name;
+  // claim the lines of chip as inputs, also reporting edges when
+  // edge_events is set (read_values works either way); returns 0 on success
+  int (*open)(const char *chip, const unsigned int *offsets,
+              unsigned int num_lines, bool edge_events);
+  void (*close)(void);
+  // current level of every line, values has room for num_lines
+  // returns 0 on success, -1 on error
+  int (*read_values)(int *values);
+  // waits at most timeout_ns for edges and returns up to max of them
+  // returns the number of edges, 0 on timeout, -1 on error
+  int (*read_events)(struct pulsein_edge *edges, unsigned int max,
+                     int64_t timeout_ns);
+  // drive a line as an output at value, it stays an output until set_input
+  int (*set_output)(unsigned int line, int value);
+  // hand a line driven by set_output back to capture
+  int (*set_input)(unsigned int line);
+  // the clock polled levels are timestamped with, in nanoseconds
+  int64_t (*timestamp)(void);
+};
+
+// libgpiod character device, v1 or v2 API depending on the build
+extern const struct pulsein_backend gpiod_backend;
+
+// In-process replay of a scripted pulse train, no GPIO needed. Every line
+// starts at idle_state and toggles after each width in turn, looping over
+// the script; set_input (i.e. the end of a trigger pulse) restarts it.
+extern const struct pulsein_backend sim_backend;
+
+// widths is a comma separated list of microseconds, alternatively
+// edge_rate > 0 replays a square wave with that many edges per second
+// returns 0 on success, -1 if the script can't be parsed
+int sim_backend_configure(const char *widths, unsigned long edge_rate,
+                          bool idle_state);
+
+#endif // PULSEIN_BACKEND_H_
@@ -0,0 +1,104 @@
+// MIT License
+//
+// Copyright (c) 2018 adafruit industries
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "pulsein_compact.h"
+
+#define SHORT_LIMIT 0x8000
+#define FIRST_OF_TWO 0xc000
+#define FIRST_OF_THREE 0xe000
+#define FIRST_MASK 0xe000
+#define CONTINUE 0x8000
+#define CONTINUE_MASK 0xc000
+
+// codes the width takes
+size_t compact_length(storage_t width) {
+  if (width < SHORT_LIMIT) {
+    return 1;
+  }
+  return width < (1UL << 27) ? 2 : 3;
+}
+
+// Writes the codes for width to out, returns how many
+size_t compact_encode(compact_code_t *out, storage_t width) {
+  uint64_t bits = width;
+  size_t len = compact_length(width);
+
+  if (len == 1) {
+    out[0] = width;
+    return 1;
+  }
+  // big end first, 14 bits per continuation
+  for (size_t i = len - 1; i > 0; i--) {
+    out[i] = CONTINUE | (bits & 0x3fff);
+    bits >>= 14;
+  }
+  out[0] = (len == 2 ? FIRST_OF_TWO : FIRST_OF_THREE) | bits;
+  return len;
+}
+
+static compact_code_t code_at(const struct circular_buf_span *codes,
+                              size_t i) {
+  if (i < codes->first_len) {
+    return ((const compact_code_t *)codes->first)[i];
+  }
+  return ((const compact_code_t *)codes->second)[i - codes->first_len];
+}
+
+// Decodes up to max widths from the codes starting at *offset into widths
+// (just counts them if widths is NULL) and moves *offset past them. A width
+// cut off by the end of codes is left for next time, codes continuing a
+// width that started before *offset are skipped. Returns the widths decoded.
+size_t compact_decode(const struct circular_buf_span *codes, size_t *offset,
+                      storage_t *widths, size_t max) {
+  size_t len = codes->first_len + codes->second_len;
+  size_t i = *offset, count = 0;
+
+  while ((count < max) && (i < len)) {
+    compact_code_t code = code_at(codes, i);
+    size_t width_len = 1;
+    uint64_t width;
+
+    if (code < SHORT_LIMIT) {
+      width = code;
+    } else if ((code & CONTINUE_MASK) == CONTINUE) {
+      // the rest of a width we never saw the start of
+      *offset = ++i;
+      continue;
+    } else {
+      width_len = (code & FIRST_MASK) == FIRST_OF_TWO ? 2 : 3;
+      if (i + width_len > len) {
+        break;
+      }
+      width = code & 0x1fff;
+      for (size_t j = 1; j < width_len; j++) {
+        width = (width << 14) | (code_at(codes, i + j) & 0x3fff);
+      }
+    }
+    if (widths) {
+      widths[count] = width;
+    }
+    count++;
+    i += width_len;
+    *offset = i;
+  }
+  return count;
+}
@@ -0,0 +1,57 @@
+// MIT License
+//
+// Copyright (c) 2018 adafruit industries
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Compact pulse widths (--compact): each width is stored as one to three 16
+// bit codes rather than a 32 bit storage_t, so short pulses take half the
+// room. The top bits of every code say what it is:
+//
+//   0xxxxxxx xxxxxxxx  a whole width below 0x8000
+//   110xxxxx xxxxxxxx  first of two codes, the top 13 of 27 bits
+//   111xxxxx xxxxxxxx  first of three codes, the top 13 of 41 bits
+//   10xxxxxx xxxxxxxx  continues the width, the next 14 bits
+//
+// A reader that starts in the middle of a width (a subscriber lapped by the
+// producer, say) can tell and skips ahead to the next first code.
+//
+// The ring counts codes. Replies decode them back to plain widths, but what
+// only looks at the ring's size (pending in binary replies, 'w' thresholds,
+// -p) is in codes, which is the pulse count as long as no width reaches
+// 0x8000.
+
+#ifndef PULSEIN_COMPACT_H_
+#define PULSEIN_COMPACT_H_
+
+#include "circular_buffer.h"
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint16_t compact_code_t;
+
+// codes a width takes at most
+#define COMPACT_CODES_MAX 3
+
+size_t compact_length(storage_t width);
+size_t compact_encode(compact_code_t *out, storage_t width);
+size_t compact_decode(const struct circular_buf_span *codes, size_t *offset,
+                      storage_t *widths, size_t max);
+
+#endif // PULSEIN_COMPACT_H_
@@ -0,0 +1,100 @@
+// MIT License
+//
+// Copyright (c) 2018 adafruit industries
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Commands arrive either on the SysV queue (-q) or on --socket connections,
+// and both end up in handle_command() with the session they came from.
+// Replies go back through the session: one SysV message each, or on a
+// socket ASCII replies end in '\n' while binary replies are delimited by the
+// count in their pulsein_binary_header. Socket sessions can also subscribe
+// to a line; its pulses are then pushed unasked, as '=' lines in ASCII or
+// with PULSEIN_FLAG_PUSH set in binary.
+
+#ifndef PULSEIN_IPC_H_
+#define PULSEIN_IPC_H_
+
+#include "circular_buffer.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// longest command a socket client may send, including the '\n'
+#define SOCKET_COMMAND_MAX 256
+// a client that lets this many reply bytes pile up gets disconnected
+#define SOCKET_OUTPUT_MAX (1024 * 1024)
+
+struct pulse_channel;
+
+struct ipc_session {
+  int queue_id; // SysV queue, or -1
+  int fd;       // socket connection, or -1
+  bool binary_replies;
+
+  // socket only: a command that hasn't seen its '\n' yet
+  char input[SOCKET_COMMAND_MAX];
+  size_t input_len;
+  // socket only: reply bytes the client hasn't taken yet
+  char *output;
+  size_t output_len;
+  // socket only: hung up or misbehaving, closed by the event loop
+  bool disconnect;
+
+  // socket only: a 'w' command the event loop answers once it's satisfied,
+  // SysV sessions just block in wait_for_pulses()
+  struct pulse_channel *wait_channel;
+  size_t wait_count;
+  int64_t wait_deadline_ns; // 0 for none
+
+  // socket only: an 's' subscription, the event loop pushes sub_channel's
+  // pulses in batches of sub_batch or once the oldest waited sub_delay_ns
+  struct pulse_channel *sub_channel;
+  uint32_t sub_position; // ring position of the next pulse to push
+  size_t sub_batch;
+  int64_t sub_delay_ns;
+  int64_t sub_deadline_ns; // 0 while nothing is waiting to be pushed
+};
+
+void handle_command(struct ipc_session *session, char *command);
+void send_reply(struct ipc_session *session, const struct iovec *iov,
+                int iovcnt);
+void send_text_reply(struct ipc_session *session, const char *text);
+void send_binary_records(struct ipc_session *session, uint32_t flags,
+                         cbuf_handle_t ringbuffer, size_t pending,
+                         storage_t *pulses, size_t count);
+void send_binary_reply(struct ipc_session *session,
+                       struct pulse_channel *channel, storage_t *pulses,
+                       size_t count);
+void send_pulse_reply(struct ipc_session *session,
+                      struct pulse_channel *channel, storage_t *pulse,
+                      bool found);
+void send_drain_reply(struct ipc_session *session,
+                      struct pulse_channel *channel, size_t requested);
+size_t send_push_reply(struct ipc_session *session);
+void send_stats_reply(struct ipc_session *session);
+
+// pulsein_socket.c
+int socket_server_start(const char *path);
+void socket_server_wake(void);
+int socket_send(struct ipc_session *session, const struct iovec *iov,
+                int iovcnt);
+
+#endif // PULSEIN_IPC_H_
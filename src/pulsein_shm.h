@@ -0,0 +1,65 @@
+// MIT License
+//
+// Copyright (c) 2018 adafruit industries
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Layout of the shared memory object created with --shm <name>. Readers
+// shm_open(name, O_RDONLY) it and mmap PROT_READ, nothing they do can disturb
+// the capture.
+//
+// The pulses are the ring buffer storage itself: slots entries of
+// record_size bytes starting header_size bytes into the object, the pulse for
+// counter n lives in slot (n & (slots - 1)). Pulses [tail, head) are valid.
+// To take a consistent snapshot without any syscall:
+//
+//   do {
+//     s1 = load_acquire(indices.seq)          // retry while odd
+//     tail = load_acquire(indices.tail)
+//     head = load_acquire(indices.head)
+//     copy slots tail .. head-1
+//     fence_acquire()
+//     s2 = load_relaxed(indices.seq)
+//   } while (s1 is odd || s1 != s2)
+//
+// All fields are in native byte order.
+
+#ifndef PULSEIN_SHM_H_
+#define PULSEIN_SHM_H_
+
+#include "circular_buffer.h"
+#include <stdint.h>
+
+#define PULSEIN_SHM_MAGIC 0x534c5550 // "PULS"
+#define PULSEIN_SHM_VERSION 2
+
+struct pulsein_shm {
+  uint32_t magic;       // PULSEIN_SHM_MAGIC
+  uint32_t version;     // PULSEIN_SHM_VERSION
+  uint32_t capacity;    // pulses the ring holds at most
+  uint32_t slots;       // pulse storage entries, a power of two
+  uint32_t record_size; // bytes per pulse, 4 for a bare 32 bit width,
+                        // 16 for a struct pulsein_record (--records) or 2
+                        // for a code of pulsein_compact.h (--compact)
+  uint32_t header_size; // offset of the pulse storage
+  uint32_t resolution_ns; // nanoseconds per unit of pulse width
+  struct circular_buf_indices indices;
+};
+
+#endif // PULSEIN_SHM_H_
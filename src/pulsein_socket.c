@@ -0,0 +1,424 @@
+// MIT License
+//
+// Copyright (c) 2018 adafruit industries
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// --socket: a Unix stream socket served by one thread around an epoll loop.
+// Every connection is an ipc_session of its own, so clients don't see each
+// other's replies and can't hold each other up. Commands are '\n' terminated.
+// Pending 'w' commands and subscriptions are served by the same thread:
+// the capture thread wakes it through an eventfd, and a timerfd covers
+// their deadlines.
+
+// accept4()
+#define _GNU_SOURCE
+#include "libgpiod_pulsein.h"
+#include "pulsein_ipc.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SOCKET_MAX_CLIENTS 64
+#define SOCKET_MAX_EVENTS 16
+
+static int listen_fd = -1, epoll_fd = -1;
+// written by notify_waiter() when a 'w' or subscription is due
+static int wake_fd = -1;
+// expires at the earliest 'w' deadline or subscription delay
+static int timer_fd = -1;
+static struct ipc_session *sessions[SOCKET_MAX_CLIENTS];
+static pthread_t socket_thread;
+
+static void *socket_thread_runner(void *args);
+
+// listens on path, replacing whatever was there, and starts serving it
+int socket_server_start(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  struct epoll_event event = {.events = EPOLLIN};
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    printf("socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  unlink(path);
+
+  listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if ((listen_fd < 0) ||
+      (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) ||
+      (listen(listen_fd, SOMAXCONN) != 0)) {
+    printf("Unable to listen on %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if ((epoll_fd < 0) || (wake_fd < 0) || (timer_fd < 0)) {
+    printf("Unable to set up the socket event loop: %s\n", strerror(errno));
+    return -1;
+  }
+  // the fds themselves tell these apart from sessions
+  event.data.ptr = &listen_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+  event.data.ptr = &wake_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event);
+  event.data.ptr = &timer_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &event);
+
+  // a client hanging up mid-reply shows up as EPIPE instead
+  signal(SIGPIPE, SIG_IGN);
+
+  if (pthread_create(&socket_thread, NULL, socket_thread_runner, NULL) != 0) {
+    printf("Unable to start the socket thread\n");
+    return -1;
+  }
+  return 0;
+}
+
+// safe from any thread
+void socket_server_wake(void) {
+  uint64_t one = 1;
+  if (wake_fd >= 0) {
+    // can only fail if the counter is about to overflow, still readable then
+    ssize_t ret = write(wake_fd, &one, sizeof(one));
+    (void)ret;
+  }
+}
+
+static void close_session(struct ipc_session *session) {
+  for (int i = 0; i < SOCKET_MAX_CLIENTS; i++) {
+    if (sessions[i] == session) {
+      sessions[i] = NULL;
+    }
+  }
+  close(session->fd);
+  free(session->output);
+  free(session);
+}
+
+static void watch_output(struct ipc_session *session, bool pending) {
+  struct epoll_event event = {.events = EPOLLIN | (pending ? EPOLLOUT : 0),
+                              .data.ptr = session};
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, session->fd, &event);
+}
+
+// Writes a reply straight from iov where the socket takes it, and keeps
+// whatever doesn't fit until it becomes writable. A client that falls more
+// than SOCKET_OUTPUT_MAX behind is marked for disconnection.
+int socket_send(struct ipc_session *session, const struct iovec *iov,
+                int iovcnt) {
+  size_t total = 0;
+  ssize_t sent = 0;
+
+  if (session->disconnect) {
+    return -1;
+  }
+  for (int i = 0; i < iovcnt; i++) {
+    total += iov[i].iov_len;
+  }
+  if (session->output_len == 0) {
+    sent = writev(session->fd, iov, iovcnt);
+    if (sent < 0) {
+      if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+        session->disconnect = true;
+        return -1;
+      }
+      sent = 0;
+    }
+    if ((size_t)sent == total) {
+      return 0;
+    }
+  }
+
+  size_t backlog = session->output_len + total - sent;
+  char *output = NULL;
+  if (backlog <= SOCKET_OUTPUT_MAX) {
+    output = realloc(session->output, backlog);
+  }
+  if (output == NULL) {
+    session->disconnect = true;
+    return -1;
+  }
+  session->output = output;
+  for (int i = 0; i < iovcnt; i++) {
+    size_t skip = (size_t)sent < iov[i].iov_len ? (size_t)sent : iov[i].iov_len;
+    memcpy(output + session->output_len, (char *)iov[i].iov_base + skip,
+           iov[i].iov_len - skip);
+    session->output_len += iov[i].iov_len - skip;
+    sent -= skip;
+  }
+  watch_output(session, true);
+  return 0;
+}
+
+static void flush_output(struct ipc_session *session) {
+  ssize_t sent = write(session->fd, session->output, session->output_len);
+  if (sent < 0) {
+    if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+      session->disconnect = true;
+    }
+    return;
+  }
+  session->output_len -= sent;
+  memmove(session->output, session->output + sent, session->output_len);
+  if (session->output_len == 0) {
+    watch_output(session, false);
+  }
+}
+
+// runs the complete commands we have, stopping at a 'w' until it's answered
+static void run_commands(struct ipc_session *session) {
+  while (!session->disconnect && (session->wait_channel == NULL)) {
+    char *newline = memchr(session->input, '\n', session->input_len);
+    if (newline == NULL) {
+      if (session->input_len == sizeof(session->input)) {
+        // no command is this long
+        session->disconnect = true;
+      }
+      return;
+    }
+    *newline = '\0';
+    if ((newline > session->input) && (newline[-1] == '\r')) {
+      newline[-1] = '\0';
+    }
+    if (session->input[0] != '\0') {
+      handle_command(session, session->input);
+    }
+    session->input_len -= newline + 1 - session->input;
+    memmove(session->input, newline + 1, session->input_len);
+  }
+}
+
+static void read_commands(struct ipc_session *session) {
+  if (session->input_len == sizeof(session->input)) {
+    // a full buffer of commands queued up behind a 'w', that's not a client
+    // we can serve
+    session->disconnect = true;
+    return;
+  }
+  ssize_t len = read(session->fd, session->input + session->input_len,
+                     sizeof(session->input) - session->input_len);
+  if (len <= 0) {
+    if ((len == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK))) {
+      // hung up
+      session->disconnect = true;
+    }
+    return;
+  }
+  session->input_len += len;
+  run_commands(session);
+}
+
+static void accept_clients(void) {
+  for (;;) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      return;
+    }
+    int slot = 0;
+    while ((slot < SOCKET_MAX_CLIENTS) && (sessions[slot] != NULL)) {
+      slot++;
+    }
+    struct ipc_session *session = NULL;
+    if (slot < SOCKET_MAX_CLIENTS) {
+      session = calloc(1, sizeof(*session));
+    }
+    if (session == NULL) {
+      close(fd);
+      continue;
+    }
+    session->queue_id = -1;
+    session->fd = fd;
+    sessions[slot] = session;
+
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = session};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+  }
+}
+
+static int64_t earliest(int64_t deadline, int64_t other) {
+  if ((deadline == 0) || ((other != 0) && (other < deadline))) {
+    return other;
+  }
+  return deadline;
+}
+
+// Answers the 'w' commands that are satisfied or out of time. Returns the
+// earliest deadline of the rest, 0 for none.
+static int64_t serve_waits(int64_t now) {
+  int64_t next_deadline = 0;
+
+  for (int i = 0; i < SOCKET_MAX_CLIENTS; i++) {
+    struct ipc_session *session = sessions[i];
+    while ((session != NULL) && (session->wait_channel != NULL)) {
+      struct pulse_channel *channel = session->wait_channel;
+      // armed before looking, see notify_waiter()
+      arm_waiter(channel, session->wait_count);
+      if ((pulse_count(channel) < session->wait_count) &&
+          ((session->wait_deadline_ns == 0) ||
+           (session->wait_deadline_ns > now))) {
+        next_deadline = earliest(next_deadline, session->wait_deadline_ns);
+        break;
+      }
+      session->wait_channel = NULL;
+      send_drain_reply(session, channel, session->wait_count);
+      // the commands that queued up behind it, possibly another 'w'
+      run_commands(session);
+    }
+  }
+
+  return next_deadline;
+}
+
+// Pushes every subscription that has a full batch, or has held on to a
+// partial one for its delay, and arms the channels to wake us for the next.
+// A subscription with nothing pending wants to hear about the first pulse,
+// which starts its delay, and after that only about a full batch: at most
+// two wakeups and a timer per batch. Returns the earliest delay still
+// running, 0 for none.
+static int64_t serve_subscriptions(int64_t now) {
+  uint32_t push_at[MAX_LINES];
+  bool wanted[MAX_LINES];
+  int64_t next_deadline;
+  bool rescan;
+
+  do {
+    next_deadline = 0;
+    memset(wanted, 0, sizeof(wanted));
+    for (int i = 0; i < SOCKET_MAX_CLIENTS; i++) {
+      struct ipc_session *session = sessions[i];
+      if ((session == NULL) || (session->sub_channel == NULL) ||
+          session->disconnect) {
+        continue;
+      }
+      cbuf_handle_t ringbuffer = session->sub_channel->ringbuffer;
+      for (;;) {
+        uint32_t pending =
+            circular_buf_head(ringbuffer) - session->sub_position;
+        if (pending == 0) {
+          session->sub_deadline_ns = 0;
+          break;
+        }
+        if (session->sub_deadline_ns == 0) {
+          session->sub_deadline_ns = now + session->sub_delay_ns;
+        }
+        if ((pending < session->sub_batch) &&
+            (session->sub_deadline_ns > now)) {
+          break;
+        }
+        send_push_reply(session);
+        // what's left starts a delay of its own
+        session->sub_deadline_ns = 0;
+      }
+
+      uint32_t target =
+          session->sub_position +
+          (session->sub_deadline_ns ? session->sub_batch : 1);
+      unsigned int line = session->sub_channel - channels;
+      if (!wanted[line] || ((int32_t)(target - push_at[line]) < 0)) {
+        push_at[line] = target;
+        wanted[line] = true;
+      }
+      next_deadline = earliest(next_deadline, session->sub_deadline_ns);
+    }
+
+    // armed before looking at the heads again, see notify_waiter(). A pulse
+    // that slipped in meanwhile means another round.
+    rescan = false;
+    for (unsigned int line = 0; line < num_channels; line++) {
+      if (!wanted[line]) {
+        continue;
+      }
+      atomic_store(&channels[line].push_at, push_at[line]);
+      atomic_store(&channels[line].push_armed, true);
+      if ((int32_t)(circular_buf_head(channels[line].ringbuffer) -
+                    push_at[line]) >= 0) {
+        rescan = true;
+      }
+    }
+  } while (rescan);
+
+  return next_deadline;
+}
+
+static void *socket_thread_runner(void *args) {
+  struct epoll_event events[SOCKET_MAX_EVENTS];
+  uint64_t count;
+
+  place_thread(&ipc_placement, "socket");
+
+  for (;;) {
+    int num_events = epoll_wait(epoll_fd, events, SOCKET_MAX_EVENTS, -1);
+    if (num_events < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      printf("Socket event loop failed: %s\n", strerror(errno));
+      exit(1);
+    }
+
+    for (int i = 0; i < num_events; i++) {
+      void *source = events[i].data.ptr;
+      if (source == &listen_fd) {
+        accept_clients();
+      } else if ((source == &wake_fd) || (source == &timer_fd)) {
+        // everything gets looked at below anyway
+        ssize_t ret = read(*(int *)source, &count, sizeof(count));
+        (void)ret;
+      } else {
+        struct ipc_session *session = source;
+        if (events[i].events & EPOLLOUT) {
+          flush_output(session);
+        }
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+          read_commands(session);
+        }
+      }
+    }
+
+    int64_t now = monotonic_ns();
+    int64_t next_deadline =
+        earliest(serve_waits(now), serve_subscriptions(now));
+    // all zero disarms it
+    struct itimerspec timer = {
+        .it_value = {next_deadline / NS_PER_SECOND,
+                     next_deadline % NS_PER_SECOND}};
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer, NULL);
+
+    for (int i = 0; i < SOCKET_MAX_CLIENTS; i++) {
+      if ((sessions[i] != NULL) && sessions[i]->disconnect) {
+        close_session(sessions[i]);
+      }
+    }
+  }
+
+  return NULL;
+}
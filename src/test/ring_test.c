@@ -0,0 +1,90 @@
+// MIT License
+//
+// Copyright (c) 2018 adafruit industries
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// circular_buf_read_at against a producer putting batches with
+// circular_buf_put_range, the way the event thread stores pulses. The
+// producer puts each value's own position, so a reader can tell a value
+// torn by a batch in flight from a good one. The ring is sized like -p 1020,
+// leaving only 4 spare slots for batches of 16. Run by `make test`.
+//
+//   ring_test [values]
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "circular_buffer.h"
+
+#define DEFAULT_VALUES 100000000UL
+#define RING_SIZE 1020
+#define BATCH 16
+#define READ_MAX 64
+
+static cbuf_handle_t ring;
+static unsigned long values;
+static atomic_bool producer_done;
+
+static void *producer(void *args) {
+  storage_t batch[BATCH];
+  for (unsigned long put = 0; put < values; put += BATCH) {
+    for (int i = 0; i < BATCH; i++) {
+      batch[i] = put + i;
+    }
+    circular_buf_put_range(ring, batch, BATCH);
+  }
+  atomic_store(&producer_done, true);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  pthread_t producer_thread;
+  storage_t data[READ_MAX];
+  unsigned long read = 0, bad = 0;
+
+  values = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_VALUES;
+  storage_t *storage =
+      calloc(circular_buf_slots(RING_SIZE), sizeof(storage_t));
+  if (!storage) {
+    printf("Unable to allocate the ring\n");
+    exit(1);
+  }
+  ring = circular_buf_init(storage, RING_SIZE);
+
+  uint32_t position = circular_buf_head(ring);
+  pthread_create(&producer_thread, NULL, producer, NULL);
+  while (!atomic_load(&producer_done)) {
+    size_t count = circular_buf_read_at(ring, &position, data, READ_MAX);
+    for (size_t i = 0; i < count; i++) {
+      if (data[i] != (storage_t)(position - count + i)) {
+        bad++;
+      }
+    }
+    read += count;
+  }
+  pthread_join(producer_thread, NULL);
+
+  printf("read_at: %lu values read, %lu torn\n", read, bad);
+  circular_buf_free(ring);
+  free(storage);
+  return bad != 0;
+}